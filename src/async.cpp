@@ -0,0 +1,102 @@
+#include "nyla.hpp"
+
+#include <coroutine>
+
+#include <xcb/xcbext.h>
+
+// Minimal coroutine layer: a handler starts a Task, the task co_awaits X replies and the loop resumes it once
+// xcb_poll_for_reply has the answer. Nothing blocks, any number of queries can be in flight while events keep being
+// dispatched. Tasks are fire-and-forget, they run synchronously until their first await and free themselves on
+// completion.
+
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { assert(false && "unhandled exception in task"); }
+    };
+};
+
+typedef struct
+{
+    u32 sequence;
+    void** reply;
+    std::coroutine_handle<> waiter;
+} PendingReply;
+
+// grows with the number of tasks in flight, a burst of new windows starts several loads each
+static PendingReply* pendingReplies;
+static u32 pendingReplyCount;
+static u32 pendingReplyCapacity;
+
+template <typename Reply>
+struct ReplyAwaiter
+{
+    u32 sequence;
+    Reply* reply;
+
+    bool await_ready() { return false; }
+
+    void await_suspend(std::coroutine_handle<> waiter)
+    {
+        if (pendingReplyCount == pendingReplyCapacity)
+        {
+            pendingReplyCapacity = pendingReplyCapacity ? pendingReplyCapacity * 2 : 256;
+            pendingReplies = (PendingReply*)realloc(pendingReplies, sizeof(PendingReply) * pendingReplyCapacity);
+            assert(pendingReplies);
+        }
+        pendingReplies[pendingReplyCount++] = {.sequence = sequence, .reply = (void**)&reply, .waiter = waiter};
+    }
+
+    // NULL on error, the error itself goes through report_error()
+    Reply* await_resume() { return reply; }
+};
+
+template <typename Reply>
+ReplyAwaiter<Reply> await_reply(u32 sequence)
+{
+    return {.sequence = sequence, .reply = NULL};
+}
+
+// co_await xcb_async(xcb_get_property, ...) yields an xcb_get_property_reply_t* the caller has to free
+#define xcb_async(name, ...) await_reply<name##_reply_t>(xcb_send(name, __VA_ARGS__).sequence)
+#define xcb_await(name, cookie) await_reply<name##_reply_t>((cookie).sequence)
+
+// Resumes every task whose reply has been read off the socket. Returns whether any task ran, in which case it may
+// have sent requests or queued events and the caller should go around again before sleeping.
+bool resume_replies()
+{
+    bool resumed = false;
+
+    for (u32 i = 0; i < pendingReplyCount;)
+    {
+        PendingReply pending = pendingReplies[i];
+        xcb_generic_error_t* error = NULL;
+
+        if (!xcb_poll_for_reply(conn, pending.sequence, pending.reply, &error))
+        {
+            ++i;
+            continue;
+        }
+
+        if (error)
+        {
+            report_error(error);
+            free(error);
+        }
+
+        // remove before resuming, the task may await again and append a new entry
+        pendingReplies[i] = pendingReplies[--pendingReplyCount];
+        trace_span("resume task");
+        u64 roundTripSaved = round_trip_enter(RoundTripResume);
+        pending.waiter.resume();
+        round_trip_leave(roundTripSaved);
+        resumed = true;
+    }
+
+    return resumed;
+}
@@ -0,0 +1,103 @@
+#include "nyla.hpp"
+
+// Chord bindings are declared as key sequences (indices into KEYS) and folded into a trie at compile time. The trie is
+// expanded into a keycode-indexed table whenever the keymap changes, so handling a key press is a single load from
+// chordTable[chordNode][keycode] no matter how many bindings there are.
+//
+// A binding's first key is grabbed with Super. The chord lasts while that key is held; keys in between descend the
+// trie, the last key fires the action and keeps the chord at its level so it can be repeated. A node with a timeout
+// resets the chord when no key follows in time.
+
+enum
+{
+#define X(key) Key_##key,
+    KEYS(X)
+#undef X
+    KeyCount
+};
+
+typedef struct
+{
+    u8 keys[4];
+    u8 length;
+    u8 action;
+    u16 timeoutMs; // applies to the intermediate nodes of this binding, 0 means wait while the chord is held
+} ChordBinding;
+
+enum
+{
+    ChordMaxNodes = 32,
+    ChordEntryAction = 0x80, // table entries: 0 ignore, node index, or ChordEntryAction | action
+};
+
+typedef struct
+{
+    u8 next[ChordMaxNodes][KeyCount]; // 0 means no transition, node 0 is the root
+    u8 action[ChordMaxNodes];         // 0 for inner nodes
+    u16 timeoutMs[ChordMaxNodes];
+    u8 nodeCount;
+    bool valid; // false when a binding is a prefix of another one or the trie ran out of nodes
+} ChordTrie;
+
+template <size_t N>
+consteval ChordTrie build_chord_trie(const ChordBinding (&bindings)[N])
+{
+    ChordTrie trie = {};
+    trie.nodeCount = 1;
+    trie.valid = true;
+
+    for (const ChordBinding& binding : bindings)
+    {
+        u8 node = 0;
+        for (u8 i = 0; i < binding.length; ++i)
+        {
+            u8 key = binding.keys[i];
+            if (trie.action[node])
+                trie.valid = false;
+
+            if (!trie.next[node][key])
+            {
+                if (trie.nodeCount == ChordMaxNodes)
+                {
+                    trie.valid = false;
+                    return trie;
+                }
+                trie.next[node][key] = trie.nodeCount++;
+            }
+
+            node = trie.next[node][key];
+            if (i + 1 < binding.length && binding.timeoutMs)
+                trie.timeoutMs[node] = binding.timeoutMs;
+        }
+
+        for (u8 key = 0; key < KeyCount; ++key)
+            if (trie.next[node][key])
+                trie.valid = false;
+        if (trie.action[node])
+            trie.valid = false;
+        trie.action[node] = binding.action;
+    }
+
+    return trie;
+}
+
+static u8 chordTable[ChordMaxNodes][256];
+static xcb_keycode_t keycodes[KeyCount];
+
+// Expands the trie for the current keycodes. Only called when the keymap changes.
+void build_chord_table(const ChordTrie& trie)
+{
+    memset(chordTable, 0, sizeof(chordTable));
+
+    for (u8 node = 0; node < trie.nodeCount; ++node)
+    {
+        for (u8 key = 0; key < KeyCount; ++key)
+        {
+            u8 child = trie.next[node][key];
+            if (!child || !keycodes[key])
+                continue;
+
+            chordTable[node][keycodes[key]] = trie.action[child] ? (ChordEntryAction | trie.action[child]) : child;
+        }
+    }
+}
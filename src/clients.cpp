@@ -0,0 +1,208 @@
+#include "nyla.hpp"
+
+// Clients live in a dense array so iteration stays linear. Outside code refers to them through generational handles
+// that go through a slot indirection: a slot keeps the client's current dense index and a generation that is bumped
+// every time the slot is freed, so a handle to a destroyed client resolves to NULL instead of to whatever client
+// reuses the slot. An open-addressing table (linear probing, backward-shift deletion) maps windows to slots. Everything
+// grows on demand, there is no cap on the client count.
+
+typedef struct
+{
+    u32 dense;      // index into clients while in use, next free slot otherwise
+    u32 generation; // never 0, so a zero handle is always invalid
+} ClientSlot;
+
+typedef struct
+{
+    xcb_window_t win; // 0 marks an empty bucket, X never hands out window 0
+    u32 slot;
+} ClientBucket;
+
+enum : u32
+{
+    ClientSlotNone = 0xFFFFFFFF
+};
+
+static Client* clients;
+static u32* clientSlotOf; // dense index -> slot, parallel to clients
+static u32 clientCount;
+static u32 clientCapacity;
+
+static ClientSlot* clientSlots;
+static u32 clientSlotCount;
+static u32 clientSlotCapacity;
+static u32 clientFreeSlot = ClientSlotNone;
+
+static ClientBucket* clientBuckets;
+static u32 clientBucketMask;
+static u32 clientBucketShift;
+
+#define client_handle(slot, generation) (((ClientHandle)(generation) << 32) | (slot))
+#define client_handle_slot(handle) ((u32)(handle))
+#define client_handle_generation(handle) ((u32)((handle) >> 32))
+
+static inline u32 client_hash(xcb_window_t win)
+{
+    // fibonacci hashing, window ids are allocated sequentially within a client's resource range
+    return (win * 0x9E3779B1u) >> clientBucketShift;
+}
+
+static ClientBucket* client_bucket(xcb_window_t win)
+{
+    if (!clientBuckets)
+        return NULL;
+
+    for (u32 i = client_hash(win) & clientBucketMask;; i = (i + 1) & clientBucketMask)
+    {
+        ClientBucket* bucket = clientBuckets + i;
+        if (bucket->win == win)
+            return bucket;
+        if (!bucket->win)
+            return NULL;
+    }
+}
+
+static void client_bucket_insert(xcb_window_t win, u32 slot)
+{
+    u32 i = client_hash(win) & clientBucketMask;
+    while (clientBuckets[i].win)
+        i = (i + 1) & clientBucketMask;
+
+    clientBuckets[i] = (ClientBucket){.win = win, .slot = slot};
+}
+
+static void client_bucket_remove(ClientBucket* bucket)
+{
+    // backward-shift deletion keeps every remaining entry reachable from its home bucket without tombstones
+    u32 hole = bucket - clientBuckets;
+    for (u32 i = (hole + 1) & clientBucketMask; clientBuckets[i].win; i = (i + 1) & clientBucketMask)
+    {
+        u32 home = client_hash(clientBuckets[i].win) & clientBucketMask;
+        if (((i - home) & clientBucketMask) >= ((i - hole) & clientBucketMask))
+        {
+            clientBuckets[hole] = clientBuckets[i];
+            hole = i;
+        }
+    }
+    clientBuckets[hole].win = 0;
+}
+
+static void client_buckets_grow()
+{
+    ClientBucket* old = clientBuckets;
+    u32 oldSize = old ? clientBucketMask + 1 : 0;
+    u32 size = oldSize ? oldSize * 2 : 64;
+
+    clientBuckets = (ClientBucket*)calloc(size, sizeof(ClientBucket));
+    assert(clientBuckets);
+    clientBucketMask = size - 1;
+    clientBucketShift = 32 - __builtin_ctz(size);
+
+    for (u32 i = 0; i < oldSize; ++i)
+        if (old[i].win)
+            client_bucket_insert(old[i].win, old[i].slot);
+
+    free(old);
+}
+
+static u32 client_slot_alloc()
+{
+    if (clientFreeSlot != ClientSlotNone)
+    {
+        u32 slot = clientFreeSlot;
+        clientFreeSlot = clientSlots[slot].dense;
+        return slot;
+    }
+
+    if (clientSlotCount == clientSlotCapacity)
+    {
+        clientSlotCapacity = clientSlotCapacity ? clientSlotCapacity * 2 : 64;
+        clientSlots = (ClientSlot*)realloc(clientSlots, sizeof(ClientSlot) * clientSlotCapacity);
+        assert(clientSlots);
+    }
+
+    clientSlots[clientSlotCount].generation = 1;
+    return clientSlotCount++;
+}
+
+Client* get_client(ClientHandle handle)
+{
+    u32 slot = client_handle_slot(handle);
+    if (slot >= clientSlotCount || clientSlots[slot].generation != client_handle_generation(handle))
+        return NULL;
+
+    return clients + clientSlots[slot].dense;
+}
+
+ClientHandle get_client_handle(u32 denseIndex)
+{
+    u32 slot = clientSlotOf[denseIndex];
+    return client_handle(slot, clientSlots[slot].generation);
+}
+
+ClientHandle find_client_handle(xcb_window_t win)
+{
+    ClientBucket* bucket = client_bucket(win);
+    return bucket ? client_handle(bucket->slot, clientSlots[bucket->slot].generation) : ClientHandleNull;
+}
+
+Client* find_client(xcb_window_t win)
+{
+    ClientBucket* bucket = client_bucket(win);
+    return bucket ? clients + clientSlots[bucket->slot].dense : NULL;
+}
+
+ClientHandle add_client(xcb_window_t win)
+{
+    if (ClientHandle existing = find_client_handle(win))
+        return existing;
+
+    // keep the load factor at or below 1/2 so probe chains stay short
+    if (!clientBuckets || (clientCount + 1) * 2 > clientBucketMask + 1)
+        client_buckets_grow();
+
+    if (clientCount == clientCapacity)
+    {
+        clientCapacity = clientCapacity ? clientCapacity * 2 : 64;
+        clients = (Client*)realloc(clients, sizeof(Client) * clientCapacity);
+        clientSlotOf = (u32*)realloc(clientSlotOf, sizeof(u32) * clientCapacity);
+        assert(clients && clientSlotOf);
+    }
+
+    u32 slot = client_slot_alloc();
+    u32 dense = clientCount++;
+    clientSlots[slot].dense = dense;
+    clientSlotOf[dense] = slot;
+
+    Client* client = clients + dense;
+    zero(client);
+    client->win = win;
+    client_bucket_insert(win, slot);
+
+    return client_handle(slot, clientSlots[slot].generation);
+}
+
+// Invalidates every handle to the client. The last client is moved into the freed dense index, its handles stay valid.
+void remove_client(xcb_window_t win)
+{
+    ClientBucket* bucket = client_bucket(win);
+    if (!bucket)
+        return;
+
+    u32 slot = bucket->slot;
+    client_bucket_remove(bucket);
+
+    u32 dense = clientSlots[slot].dense;
+    u32 last = --clientCount;
+    if (dense != last)
+    {
+        clients[dense] = clients[last];
+        clientSlotOf[dense] = clientSlotOf[last];
+        clientSlots[clientSlotOf[dense]].dense = dense;
+    }
+
+    if (!++clientSlots[slot].generation)
+        clientSlots[slot].generation = 1;
+    clientSlots[slot].dense = clientFreeSlot;
+    clientFreeSlot = slot;
+}
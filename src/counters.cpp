@@ -0,0 +1,203 @@
+#include "nyla.hpp"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+// Optional per-handler hardware counters. One perf_event_open group on this thread, read (one syscall for the whole
+// group) before and after every handler and accumulated per event type next to the latency histograms. Two reads per
+// event cost about a microsecond, so the group is off unless NYLA_COUNTERS=1 or 'counters on' enables it. Where the
+// PMU is not available (VMs, perf_event_paranoid, no driver) a group of software counters is used instead. If the
+// kernel side cannot be counted either, the counters are restricted to user space; context switches then read 0.
+
+// name, perf type, config
+#define HARDWARE_COUNTERS(X)                                                                                           \
+    X(cycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES)                                                            \
+    X(instructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS)                                                    \
+    X(llc_misses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES)                                                      \
+    X(branch_misses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES)                                                  \
+    X(context_switches, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES)
+
+#define SOFTWARE_COUNTERS(X)                                                                                           \
+    X(task_clock_ns, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK)                                                     \
+    X(page_faults, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS)                                                      \
+    X(context_switches, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES)                                            \
+    X(cpu_migrations, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS)
+
+typedef struct
+{
+    const char* name;
+    u32 type;
+    u64 config;
+} CounterSpec;
+
+static const CounterSpec hardwareCounters[] = {
+#define X(name, type, config) {#name, type, config},
+    HARDWARE_COUNTERS(X)
+#undef X
+};
+
+static const CounterSpec softwareCounters[] = {
+#define X(name, type, config) {#name, type, config},
+    SOFTWARE_COUNTERS(X)
+#undef X
+};
+
+enum : u32
+{
+    CounterMax = 8,
+};
+
+typedef struct
+{
+    u64 count;
+    u64 values[CounterMax];
+} HandlerCounters;
+
+typedef struct
+{
+    u64 nr;
+    u64 values[CounterMax];
+} CounterGroupRead;
+
+static struct
+{
+    int fds[CounterMax];
+    int leader; // -1 while off
+    u32 count;
+    const CounterSpec* specs;
+    bool userOnly;
+    HandlerCounters handlers[MetricsEventTypes];
+} counters = {.leader = -1};
+
+static int counter_open(const CounterSpec* spec, int group, bool userOnly)
+{
+    struct perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = spec->type;
+    attr.config = spec->config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = userOnly;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+static bool counter_group_open(const CounterSpec* specs, u32 count, bool userOnly)
+{
+    for (u32 i = 0; i < count; ++i)
+    {
+        int fd = counter_open(specs + i, i ? counters.fds[0] : -1, userOnly);
+        if (fd < 0)
+        {
+            for (u32 j = 0; j < i; ++j)
+                close(counters.fds[j]);
+            return false;
+        }
+        counters.fds[i] = fd;
+    }
+
+    counters.leader = counters.fds[0];
+    counters.count = count;
+    counters.specs = specs;
+    counters.userOnly = userOnly;
+    ioctl(counters.leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counters.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+bool counters_enable()
+{
+    if (counters.leader >= 0)
+        return true;
+
+    for (bool userOnly : {false, true})
+    {
+        if (counter_group_open(hardwareCounters, std::size(hardwareCounters), userOnly) ||
+            counter_group_open(softwareCounters, std::size(softwareCounters), userOnly))
+        {
+            debug_fmt("counters: %s group%s",
+                      counters.specs == hardwareCounters ? "hardware" : "software",
+                      userOnly ? ", user space only" : "");
+            return true;
+        }
+    }
+
+    debug_fmts("counters: perf_event_open is not available");
+    return false;
+}
+
+void counters_disable()
+{
+    if (counters.leader < 0)
+        return;
+
+    for (u32 i = 0; i < counters.count; ++i)
+        close(counters.fds[i]);
+    counters.leader = -1;
+}
+
+void counters_reset()
+{
+    memset(counters.handlers, 0, sizeof(counters.handlers));
+}
+
+// Both return false while the counters are off, which is the only cost then.
+static inline bool counters_begin(CounterGroupRead* sample)
+{
+    if (__builtin_expect(counters.leader < 0, 1))
+        return false;
+
+    return read(counters.leader, sample, sizeof(*sample)) > 0;
+}
+
+static inline void counters_end(const CounterGroupRead* before, u8 responseType)
+{
+    CounterGroupRead after;
+    if (counters.leader < 0 || read(counters.leader, &after, sizeof(after)) <= 0)
+        return;
+
+    HandlerCounters* handler = counters.handlers + metrics_event_slot(responseType);
+    ++handler->count;
+    for (u32 i = 0; i < counters.count; ++i)
+        handler->values[i] += after.values[i] - before->values[i];
+}
+
+void counters_report(IpcReply* reply, const char* extensionName)
+{
+    if (counters.leader < 0)
+    {
+        ipc_printf(reply, "\ncounters off, 'counters on' enables them\n");
+        return;
+    }
+
+    ipc_printf(reply,
+               "\n%s counters per event%s\n%-18s %10s",
+               counters.specs == hardwareCounters ? "hardware" : "software",
+               counters.userOnly ? ", user space only" : "",
+               "event",
+               "count");
+    for (u32 i = 0; i < counters.count; ++i)
+        ipc_printf(reply, " %16s", counters.specs[i].name);
+    if (counters.specs == hardwareCounters)
+        ipc_printf(reply, " %6s", "ipc");
+    ipc_printf(reply, "\n");
+
+    for (u32 slot = 0; slot < MetricsEventTypes; ++slot)
+    {
+        const HandlerCounters* handler = counters.handlers + slot;
+        if (!handler->count)
+            continue;
+
+        ipc_printf(reply,
+                   "%-18s %10llu",
+                   slot < MetricsExtensionEvents ? coreEventNames[slot] : extensionName,
+                   (unsigned long long)handler->count);
+        for (u32 i = 0; i < counters.count; ++i)
+            ipc_printf(reply, " %16.1f", (double)handler->values[i] / handler->count);
+        if (counters.specs == hardwareCounters)
+            ipc_printf(reply, " %6.2f", handler->values[0] ? (double)handler->values[1] / handler->values[0] : 0.0);
+        ipc_printf(reply, "\n");
+    }
+}
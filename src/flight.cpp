@@ -0,0 +1,107 @@
+#include "nyla.hpp"
+#include "flight.hpp"
+
+// Always-on flight recorder: every dispatched event leaves a FlightEntry in a fixed ring, a handful of plain stores and
+// two TSC reads per event. Only the event loop writes to it, so it needs no atomics; signal fences keep the stores in
+// program order for a dump taken from a signal handler on the same thread. The ring is written to a file on SIGUSR1
+// and from the crash handler (the assert macro faults through NULL), render it with nylaflight.
+//
+// The dump goes to NYLA_FLIGHT, by default $XDG_RUNTIME_DIR/nyla-flight.
+
+static struct
+{
+    FlightEntry entries[FlightCapacity];
+    u64 next;
+    u64 tscStart;
+    u64 nsStart;
+    u8 xkbEventBase;
+    char path[256];
+} flightRecorder;
+
+static char flightAltStack[16384];
+
+static inline FlightEntry* flight_begin(const xcb_generic_event_t* e)
+{
+    FlightEntry* entry = flightRecorder.entries + (flightRecorder.next & (FlightCapacity - 1));
+    *entry = (FlightEntry){
+        .tsc = read_tsc(),
+        .cycles = FlightRunning,
+        .sequence = e->sequence,
+        .type = e->response_type,
+    };
+    std::atomic_signal_fence(std::memory_order_release);
+    ++flightRecorder.next;
+    return entry;
+}
+
+static inline void flight_end(FlightEntry* entry, u32 requests)
+{
+    u64 cycles = read_tsc() - entry->tsc;
+    entry->requests = requests < 0xFFFF ? requests : 0xFFFF;
+    std::atomic_signal_fence(std::memory_order_release);
+    entry->cycles = cycles < FlightRunning ? cycles : FlightRunning - 1;
+}
+
+// Async-signal-safe.
+static bool flight_dump(int reason)
+{
+    FlightHeader header = {
+        .reason = (u32)reason,
+        .capacity = FlightCapacity,
+        .next = flightRecorder.next,
+        .tscStart = flightRecorder.tscStart,
+        .nsStart = flightRecorder.nsStart,
+        .tscDump = read_tsc(),
+        .nsDump = now_ns(),
+        .xkbEventBase = flightRecorder.xkbEventBase,
+    };
+    memcpy(header.magic, FlightMagic, sizeof(header.magic));
+
+    int fd = open(flightRecorder.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    bool ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+              write(fd, flightRecorder.entries, sizeof(flightRecorder.entries)) == sizeof(flightRecorder.entries);
+    close(fd);
+    return ok;
+}
+
+static void flight_crash(int signo)
+{
+    flight_dump(signo);
+    // SA_RESETHAND restored the default action, returning re-executes the fault or lets abort() re-raise
+}
+
+void flight_signal(void* data, u64 signo)
+{
+    if (flight_dump(signo))
+        debug_fmt("flight recorder: %llu events dumped to %s",
+                  (unsigned long long)(flightRecorder.next < FlightCapacity ? flightRecorder.next : FlightCapacity),
+                  flightRecorder.path);
+}
+
+void flight_init(u8 xkbEventBase)
+{
+    flightRecorder.tscStart = read_tsc();
+    flightRecorder.nsStart = now_ns();
+    flightRecorder.xkbEventBase = xkbEventBase;
+
+    const char* path = getenv("NYLA_FLIGHT");
+    const char* runtimeDir = getenv("XDG_RUNTIME_DIR");
+    if (path && *path)
+        snprintf(flightRecorder.path, sizeof(flightRecorder.path), "%s", path);
+    else
+        snprintf(flightRecorder.path, sizeof(flightRecorder.path), "%s/nyla-flight", runtimeDir ? runtimeDir : "/tmp");
+
+    // an alternate stack so a stack overflow still gets its dump
+    stack_t stack = {.ss_sp = flightAltStack, .ss_flags = 0, .ss_size = sizeof(flightAltStack)};
+    sigaltstack(&stack, NULL);
+
+    struct sigaction action = {};
+    action.sa_handler = flight_crash;
+    action.sa_flags = SA_RESETHAND | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for (int signo : {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT})
+        sigaction(signo, &action, NULL);
+}
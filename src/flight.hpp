@@ -0,0 +1,50 @@
+#pragma once
+
+// Flight recorder dump format and event names, shared by the WM and the nylaflight timeline tool. Expects the u8..u64
+// typedefs.
+//
+// A dump is a FlightHeader followed by all FlightCapacity entries of the ring in slot order; the newest entry is at
+// (next - 1) % FlightCapacity and only the last min(next, FlightCapacity) entries are meaningful.
+
+#define FlightMagic "NYLAFLT1"
+
+enum : u32
+{
+    FlightCapacity = 8192,  // power of two
+    FlightRunning = 0xFFFFFFFF, // cycles of a handler that had not returned when the dump was taken
+};
+
+typedef struct
+{
+    u64 tsc;      // dispatch start
+    u32 cycles;   // handler duration, saturated below FlightRunning
+    u32 window;   // the window the event is about, 0 when there is none
+    u16 sequence; // of the event
+    u16 requests; // X requests the handler issued
+    u8 type;      // response_type, including the SendEvent bit
+    u8 pad[3];
+} FlightEntry;
+
+typedef struct
+{
+    char magic[8];
+    u32 reason; // signal that triggered the dump
+    u32 capacity;
+    u64 next; // entries ever recorded
+    // two (tsc, CLOCK_MONOTONIC) pairs to convert timestamps
+    u64 tscStart;
+    u64 nsStart;
+    u64 tscDump;
+    u64 nsDump;
+    u8 xkbEventBase;
+    u8 pad[7];
+} FlightHeader;
+
+static const char* const coreEventNames[] = {
+    "Error",           "Reply",          "KeyPress",        "KeyRelease",      "ButtonPress",   "ButtonRelease",
+    "MotionNotify",    "EnterNotify",    "LeaveNotify",     "FocusIn",         "FocusOut",      "KeymapNotify",
+    "Expose",          "GraphicsExpose", "NoExpose",        "VisibilityNotify", "CreateNotify", "DestroyNotify",
+    "UnmapNotify",     "MapNotify",      "MapRequest",      "ReparentNotify",  "ConfigureNotify", "ConfigureRequest",
+    "GravityNotify",   "ResizeRequest",  "CirculateNotify", "CirculateRequest", "PropertyNotify", "SelectionClear",
+    "SelectionRequest", "SelectionNotify", "ColormapNotify", "ClientMessage",  "MappingNotify", "GenericEvent",
+};
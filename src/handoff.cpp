@@ -0,0 +1,100 @@
+#include "nyla.hpp"
+
+#include <sys/mman.h>
+
+// State handed from the old image to the new one across restart(): a sealed memfd whose number travels in
+// NYLA_STATE_FD. The layout is a fixed header followed by clientCount HandoffClient records; the version is bumped on
+// any layout change and a mismatching image falls back to a fresh scan.
+
+enum : u32
+{
+    HandoffMagic = 0x616c796e, // "nyla"
+    HandoffVersion = 1,
+    HandoffNone = 0xFFFFFFFF,
+};
+
+typedef struct
+{
+    u32 magic;
+    u32 version;
+    u32 size; // of the whole blob
+    u32 clientCount;
+    u32 activeClients[2]; // index into the client records or HandoffNone
+    xcb_window_t focusedWindow;
+    u8 activeCol;
+    u8 poolPendingCount;
+    u8 pad[2];
+    i32 poolPending[8];
+} HandoffHeader;
+
+typedef struct
+{
+    xcb_window_t win;
+    u32 flags;
+    i16 x;
+    i16 y;
+    u16 width;
+    u16 height;
+    u8 borderWidth;
+    u8 stackMode;
+    u8 pad[2];
+    i32 poolPid; // non-zero for a warm terminal waiting in the pool
+} HandoffClient;
+
+// Returns an fd that survives exec, or -1.
+int handoff_write(const void* data, u32 size)
+{
+    int fd = memfd_create("nyla-state", MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return -1;
+
+    if (write(fd, data, size) != (ssize_t)size)
+    {
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    return fd;
+}
+
+// Takes the state fd passed by the previous image, if any, and maps it read-only. The fd is closed and the
+// environment cleared so nothing leaks into spawned children. Release with handoff_release().
+const HandoffHeader* handoff_read(u32* size)
+{
+    const char* env = getenv("NYLA_STATE_FD");
+    if (!env)
+        return NULL;
+
+    int fd = atoi(env);
+    unsetenv("NYLA_STATE_FD");
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(HandoffHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    const HandoffHeader* header = (const HandoffHeader*)data;
+    if (header->magic != HandoffMagic || header->version != HandoffVersion || header->size != st.st_size ||
+        header->size != sizeof(HandoffHeader) + header->clientCount * sizeof(HandoffClient))
+    {
+        debug_fmts("ignoring incompatible restart state");
+        munmap(data, st.st_size);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return header;
+}
+
+void handoff_release(const HandoffHeader* header, u32 size)
+{
+    munmap((void*)header, size);
+}
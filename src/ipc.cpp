@@ -0,0 +1,185 @@
+#include "nyla.hpp"
+
+#include <errno.h>
+#include <stdarg.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Control socket for runtime queries. One command line per connection: the client writes it, the loop runs the command
+// and answers with text, then closes. Commands are tiny and answers fit in the socket buffer, so neither side blocks
+// the loop. At most IpcMaxClients connections are open at a time, further ones are closed right away, and a connection
+// that has not sent its command within IpcTimeoutNs is dropped, so idle clients cannot use up the loop's sources.
+// The socket is NYLA_SOCKET, by default $XDG_RUNTIME_DIR/nyla.sock; nylactl is the client.
+
+enum : u32
+{
+    IpcMaxClients = 4,
+    IpcTimeoutNs = 1000000000,
+};
+
+typedef struct
+{
+    char data[65536];
+    u32 length;
+} IpcReply;
+
+typedef void (*IpcHandler)(IpcReply* reply, char* command);
+
+static int ipcFd = -1;
+static IpcHandler ipcHandler;
+
+static struct
+{
+    int fd; // -1 when free
+    u64 acceptedAt;
+} ipcClients[IpcMaxClients];
+
+// one-shot, armed for the oldest open connection
+static int ipcTimer = -1;
+
+__attribute__((format(printf, 2, 3))) void ipc_printf(IpcReply* reply, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(reply->data + reply->length, sizeof(reply->data) - reply->length, fmt, args);
+    va_end(args);
+
+    if (n > 0)
+        reply->length = reply->length + n < sizeof(reply->data) ? reply->length + n : sizeof(reply->data) - 1;
+}
+
+static void ipc_close(int fd)
+{
+    for (auto& client : ipcClients)
+        if (client.fd == fd)
+            client.fd = -1;
+
+    loop_remove_fd(fd);
+    close(fd);
+}
+
+static void ipc_read(void* data, u64 events)
+{
+    int fd = (int)(intptr_t)data;
+
+    char command[256];
+    ssize_t n = read(fd, command, sizeof(command) - 1);
+    if (n < 0 && errno == EAGAIN)
+        return;
+
+    if (n > 0)
+    {
+        command[n] = '\0';
+        command[strcspn(command, "\r\n")] = '\0';
+
+        static IpcReply reply;
+        reply.length = 0;
+        reply.data[0] = '\0';
+        ipcHandler(&reply, command);
+
+        for (u32 done = 0; done < reply.length;)
+        {
+            ssize_t written = write(fd, reply.data + done, reply.length - done);
+            if (written <= 0)
+                break;
+            done += written;
+        }
+    }
+
+    ipc_close(fd);
+}
+
+static void ipc_arm_timeout(u64 now)
+{
+    u64 oldest = 0;
+    for (auto& client : ipcClients)
+        if (client.fd >= 0 && (!oldest || client.acceptedAt < oldest))
+            oldest = client.acceptedAt;
+
+    // a zero initial value would disarm it
+    if (oldest)
+        loop_arm_timer(ipcTimer, oldest + IpcTimeoutNs > now ? oldest + IpcTimeoutNs - now : 1, 0);
+}
+
+static void ipc_timeout(void* data, u64 expirations)
+{
+    u64 now = now_ns();
+    for (auto& client : ipcClients)
+    {
+        if (client.fd >= 0 && now - client.acceptedAt >= IpcTimeoutNs)
+        {
+            debug_fmt("control connection %d sent no command, closing it", client.fd);
+            ipc_close(client.fd);
+        }
+    }
+    ipc_arm_timeout(now);
+}
+
+static void ipc_accept(void* data, u64 events)
+{
+    int fd = accept4(ipcFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    for (auto& client : ipcClients)
+    {
+        if (client.fd >= 0)
+            continue;
+
+        if (!loop_add_fd(fd, EPOLLIN, ipc_read, (void*)(intptr_t)fd))
+            break;
+
+        bool first = true;
+        for (auto& other : ipcClients)
+            first &= other.fd < 0;
+
+        client = {.fd = fd, .acceptedAt = now_ns()};
+        if (first)
+            loop_arm_timer(ipcTimer, IpcTimeoutNs, 0);
+        return;
+    }
+
+    close(fd);
+}
+
+void ipc_init(IpcHandler handler)
+{
+    const char* path = getenv("NYLA_SOCKET");
+    char defaultPath[108];
+    if (!path || !*path)
+    {
+        const char* runtimeDir = getenv("XDG_RUNTIME_DIR");
+        snprintf(defaultPath, sizeof(defaultPath), "%s/nyla.sock", runtimeDir ? runtimeDir : "/tmp");
+        path = defaultPath;
+    }
+
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        debug_fmt("socket path %s is too long", path);
+        return;
+    }
+    strcpy(address.sun_path, path);
+
+    ipcFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ipcFd < 0)
+        return;
+
+    // a stale socket from a crashed instance would make bind fail
+    unlink(path);
+    if (bind(ipcFd, (struct sockaddr*)&address, sizeof(address)) || listen(ipcFd, 4))
+    {
+        debug_fmt("could not listen on %s", path);
+        close(ipcFd);
+        ipcFd = -1;
+        return;
+    }
+
+    for (auto& client : ipcClients)
+        client.fd = -1;
+    ipcTimer = loop_add_timer(0, 0, ipc_timeout, NULL);
+
+    ipcHandler = handler;
+    loop_add_fd(ipcFd, EPOLLIN, ipc_accept, NULL);
+}
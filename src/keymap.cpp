@@ -0,0 +1,104 @@
+#include "nyla.hpp"
+
+// xkb.h names struct members 'explicit', which is a keyword in C++
+#define explicit explicit_
+#include <xcb/xkb.h>
+#undef explicit
+
+// Keeps the group 1 keysym of every keycode so a keymap change only refetches the keycode range it touched and only
+// the KEYS whose keycode actually moved need to be re-grabbed. Changes come in as XKB MapNotify/NewKeyboardNotify when
+// the extension is there and as core MappingNotify otherwise.
+
+static xcb_keysym_t keysymTable[256];
+static u8 xkbEventBase;
+static bool xkbAvailable;
+
+static const xcb_keysym_t keySyms[] = {
+#define X(key) XK_##key,
+    KEYS(X)
+#undef X
+};
+static_assert(std::size(keySyms) <= 32, "KEYS does not fit the changed-key mask");
+
+// Detectable autorepeat makes a held key produce press, press, ..., release instead of release/press pairs, so a held
+// chord key is not mistaken for a release.
+bool init_xkb()
+{
+    xcb_reply_var(extension, xcb_xkb_use_extension, 1, 0);
+    if (!extension || !extension->supported)
+    {
+        free(extension);
+        debug_fmts("XKB not available, falling back to core MappingNotify");
+        return false;
+    }
+    free(extension);
+
+    xkbEventBase = xcb_get_extension_data(conn, &xcb_xkb_id)->first_event;
+    xkbAvailable = true;
+
+    xcb_reply_var(flags,
+                  xcb_xkb_per_client_flags,
+                  XCB_XKB_ID_USE_CORE_KBD,
+                  XCB_XKB_PER_CLIENT_FLAG_DETECTABLE_AUTO_REPEAT,
+                  XCB_XKB_PER_CLIENT_FLAG_DETECTABLE_AUTO_REPEAT,
+                  0,
+                  0,
+                  0);
+    if (!flags || !(flags->supported & XCB_XKB_PER_CLIENT_FLAG_DETECTABLE_AUTO_REPEAT))
+        debug_fmts("XKB detectable autorepeat not supported");
+    free(flags);
+
+    u16 events = XCB_XKB_EVENT_TYPE_NEW_KEYBOARD_NOTIFY | XCB_XKB_EVENT_TYPE_MAP_NOTIFY;
+    xcb_tracked(xcb_xkb_select_events,
+                XCB_XKB_ID_USE_CORE_KBD,
+                events,
+                0,
+                events,
+                XCB_XKB_MAP_PART_KEY_SYMS,
+                XCB_XKB_MAP_PART_KEY_SYMS,
+                NULL);
+
+    return true;
+}
+
+// Patches keysymTable for [first, first + count) from the reply and recomputes the keycode of every key that could
+// have been affected. Returns a mask of the keys whose keycode changed, their previous keycodes go to oldKeycodes.
+u32 store_keymap(xcb_get_keyboard_mapping_reply_t* reply, xcb_keycode_t first, u32 count, xcb_keycode_t* oldKeycodes)
+{
+    if (!reply)
+        return 0;
+
+    u32 perKeycode = reply->keysyms_per_keycode;
+    xcb_keysym_t* syms = xcb_get_keyboard_mapping_keysyms(reply);
+    u32 available = perKeycode ? xcb_get_keyboard_mapping_keysyms_length(reply) / perKeycode : 0;
+    if (count > available)
+        count = available;
+
+    for (u32 i = 0; i < count && first + i < std::size(keysymTable); ++i)
+        keysymTable[first + i] = syms[i * perKeycode];
+
+    u32 changed = 0;
+    for (u32 key = 0; key < std::size(keySyms); ++key)
+    {
+        bool inRange = keycodes[key] >= first && keycodes[key] < first + count;
+        for (u32 i = 0; i < count && !inRange; ++i)
+            inRange = keysymTable[first + i] == keySyms[key];
+        if (!inRange)
+            continue;
+
+        // same rule as xcb_key_symbols_get_keycode: the lowest keycode wins
+        xcb_keycode_t keycode = 0;
+        for (u32 kc = 0; kc < std::size(keysymTable) && !keycode; ++kc)
+            if (keysymTable[kc] == keySyms[key])
+                keycode = kc;
+
+        if (keycode != keycodes[key])
+        {
+            oldKeycodes[key] = keycodes[key];
+            keycodes[key] = keycode;
+            changed |= 1u << key;
+        }
+    }
+
+    return changed;
+}
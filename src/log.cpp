@@ -0,0 +1,323 @@
+#include "nyla.hpp"
+
+#include <pthread.h>
+
+// Asynchronous log. debug_fmt only claims a fixed-size slot in a bounded lock-free ring (Vyukov's MPMC scheme, any
+// thread may log, e.g. the GL debug callback) and copies the site pointer, a timestamp and the raw arguments into it.
+// A background thread drains the ring, formats text or emits the binary format from log.hpp, and does the write()s,
+// so a slow disk never blocks the event loop. When the ring is full entries are dropped and counted rather than
+// waited for. The thread sleeps on a futex while the ring is empty; only the entry that finds it asleep pays for the
+// wakeup, so an idle WM causes no wakeups. log_flush() drains synchronously and is called before exec and from assert.
+//
+// NYLA_LOG names the log file (default $HOME/nylalog), NYLA_LOG_BINARY=1 switches to the binary format; decode it with
+// nylalog.
+
+enum : u32
+{
+    LogSlotCount = 4096,
+    LogPayloadSize = 96,
+};
+
+typedef struct
+{
+    std::atomic<u64> sequence;
+    const LogSite* site;
+    u64 timestamp;
+    u16 size;
+    u8 pad[6];
+    u8 payload[LogPayloadSize];
+} LogSlot;
+
+static_assert(sizeof(LogSlot) == 128);
+
+static struct
+{
+    alignas(64) std::atomic<u64> head;
+    alignas(64) u64 tail; // consumer side, guarded by drainLock
+    std::atomic<u64> dropped;
+    std::atomic<u32> sleeping; // the log thread is (about to be) waiting for the next entry
+    std::atomic_flag drainLock;
+    LogSlot slots[LogSlotCount];
+} logRing;
+
+static int logFd = STDERR_FILENO;
+static bool logBinary;
+
+// binary mode only: sites that already have a definition in the file
+static const LogSite* logSitesWritten[1024];
+
+static char logBuffer[65536];
+static u32 logBufferSize;
+
+static void log_buffer_flush()
+{
+    for (u32 done = 0; done < logBufferSize;)
+    {
+        ssize_t n = write(logFd, logBuffer + done, logBufferSize - done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    logBufferSize = 0;
+}
+
+static void log_buffer_put(const void* data, u32 size)
+{
+    if (logBufferSize + size > sizeof(logBuffer))
+        log_buffer_flush();
+    if (size > sizeof(logBuffer))
+        return;
+
+    memcpy(logBuffer + logBufferSize, data, size);
+    logBufferSize += size;
+}
+
+template <typename T> static void log_buffer_put_value(T value)
+{
+    log_buffer_put(&value, sizeof(value));
+}
+
+static void log_define_site(const LogSite* site)
+{
+    u32 i = ((uintptr_t)site >> 3) * 0x9E3779B1u % std::size(logSitesWritten);
+    for (u32 probe = 0; probe < std::size(logSitesWritten); ++probe, i = (i + 1) % std::size(logSitesWritten))
+    {
+        if (logSitesWritten[i] == site)
+            return;
+        if (!logSitesWritten[i])
+        {
+            logSitesWritten[i] = site;
+            break;
+        }
+    }
+
+    // past 1024 sites definitions are repeated, which the decoder tolerates
+    u16 fileLength = strlen(site->file);
+    u16 fmtLength = strlen(site->fmt);
+    log_buffer_put_value((u8)LogRecordSite);
+    log_buffer_put_value((u64)(uintptr_t)site);
+    log_buffer_put_value(site->line);
+    log_buffer_put_value(site->kinds);
+    log_buffer_put_value((u8)site->argCount);
+    log_buffer_put_value(fileLength);
+    log_buffer_put_value(fmtLength);
+    log_buffer_put(site->file, fileLength);
+    log_buffer_put(site->fmt, fmtLength);
+}
+
+static void log_emit(const LogSlot* slot)
+{
+    if (logBinary)
+    {
+        log_define_site(slot->site);
+        log_buffer_put_value((u8)LogRecordEntry);
+        log_buffer_put_value((u64)(uintptr_t)slot->site);
+        log_buffer_put_value(slot->timestamp);
+        log_buffer_put_value(slot->size);
+        log_buffer_put(slot->payload, slot->size);
+        return;
+    }
+
+    char line[1024];
+    u32 length = snprintf(line, sizeof(line), "[%s:%d] ", slot->site->file, slot->site->line);
+    length += log_format(slot->site->fmt,
+                         slot->site->kinds,
+                         slot->site->argCount,
+                         slot->payload,
+                         slot->size,
+                         line + length,
+                         sizeof(line) - length - 1);
+    line[length++] = '\n';
+    log_buffer_put(line, length);
+}
+
+static void log_emit_dropped(u64 dropped)
+{
+    if (logBinary)
+    {
+        log_buffer_put_value((u8)LogRecordDropped);
+        log_buffer_put_value(dropped);
+        return;
+    }
+
+    char line[64];
+    log_buffer_put(line, snprintf(line, sizeof(line), "[log] %llu entries dropped\n", (unsigned long long)dropped));
+}
+
+// Returns the number of entries written. Only one drainer at a time; the log thread and log_flush() share this.
+static u32 log_drain()
+{
+    u32 count = 0;
+    for (;;)
+    {
+        LogSlot* slot = logRing.slots + (logRing.tail % LogSlotCount);
+        if (slot->sequence.load(std::memory_order_acquire) != logRing.tail + 1)
+            break;
+
+        log_emit(slot);
+        slot->sequence.store(logRing.tail + LogSlotCount, std::memory_order_release);
+        ++logRing.tail;
+        ++count;
+    }
+
+    if (u64 dropped = logRing.dropped.exchange(0, std::memory_order_relaxed))
+        log_emit_dropped(dropped);
+
+    if (logBufferSize)
+        log_buffer_flush();
+    return count;
+}
+
+void log_record(const LogSite* site, const u64* values, u32 count)
+{
+    LogSlot* slot;
+    u64 position = logRing.head.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        slot = logRing.slots + (position % LogSlotCount);
+        i64 lag = (i64)(slot->sequence.load(std::memory_order_acquire) - position);
+        if (!lag)
+        {
+            if (logRing.head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (lag < 0)
+        {
+            logRing.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            position = logRing.head.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->site = site;
+    slot->timestamp = now_ns();
+
+    u8* out = slot->payload;
+    u8* end = slot->payload + LogPayloadSize;
+    for (u32 i = 0; i < count; ++i)
+    {
+        u8 kind = log_kind(site->kinds, i);
+        if (kind != LogArgString && kind != LogArgStringBounded)
+        {
+            if (out + 8 > end)
+                break;
+            memcpy(out, values + i, 8);
+            out += 8;
+            continue;
+        }
+
+        // strings are truncated to what is left of the slot
+        const char* string = (const char*)(uintptr_t)values[i];
+        if (!string)
+            string = "(null)";
+        if (out + 2 > end)
+            break;
+
+        u32 room = end - out - 2;
+        if (kind == LogArgStringBounded && i && (i64)values[i - 1] >= 0 && values[i - 1] < room)
+            room = values[i - 1];
+        u16 length = strnlen(string, room);
+        memcpy(out, &length, 2);
+        memcpy(out + 2, string, length);
+        out += 2 + length;
+    }
+    slot->size = out - slot->payload;
+
+    slot->sequence.store(position + 1, std::memory_order_release);
+
+    // pairs with the fence in log_thread: either it sees this entry or this sees it asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (logRing.sleeping.load(std::memory_order_relaxed) && logRing.sleeping.exchange(0, std::memory_order_relaxed))
+        logRing.sleeping.notify_one();
+}
+
+void log_flush()
+{
+    while (logRing.drainLock.test_and_set(std::memory_order_acquire))
+        ;
+    log_drain();
+    logRing.drainLock.clear(std::memory_order_release);
+}
+
+static void* log_thread(void*)
+{
+    for (;;)
+    {
+        u32 count = 0;
+        if (!logRing.drainLock.test_and_set(std::memory_order_acquire))
+        {
+            count = log_drain();
+            logRing.drainLock.clear(std::memory_order_release);
+        }
+
+        if (count)
+            continue;
+
+        logRing.sleeping.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        // an entry published before the flag was visible would otherwise wait for the next one
+        LogSlot* slot = logRing.slots + (logRing.tail % LogSlotCount);
+        if (slot->sequence.load(std::memory_order_acquire) == logRing.tail + 1 ||
+            logRing.dropped.load(std::memory_order_relaxed))
+        {
+            logRing.sleeping.store(0, std::memory_order_relaxed);
+            continue;
+        }
+
+        logRing.sleeping.wait(1, std::memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static void log_exit()
+{
+    log_flush();
+}
+
+void log_init()
+{
+    for (u32 i = 0; i < LogSlotCount; ++i)
+        logRing.slots[i].sequence.store(i, std::memory_order_relaxed);
+
+    const char* path = getenv("NYLA_LOG");
+    char defaultPath[256];
+    if (!path || !*path)
+    {
+        const char* home = getenv("HOME");
+        snprintf(defaultPath, sizeof(defaultPath), "%s/nylalog", home ? home : "/tmp");
+        path = defaultPath;
+    }
+
+    const char* binary = getenv("NYLA_LOG_BINARY");
+    logBinary = binary && *binary == '1';
+
+    int fd = open(path, O_APPEND | O_TRUNC | O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0)
+        logFd = fd;
+    else
+        logBinary = false;
+
+    if (logBinary)
+    {
+        log_buffer_put(LogFileMagic, strlen(LogFileMagic));
+        log_buffer_flush();
+    }
+
+    atexit(log_exit);
+
+    // the thread must not take any of the signals the loop reads through signalfd
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    pthread_create(&thread, NULL, log_thread, NULL);
+    pthread_setname_np(thread, "nyla-log");
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (fd < 0)
+        debug_fmt("could not open log %s, logging to stderr", path);
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+// Binary log format shared by the WM and the nylalog decoder. Expects <stdio.h>, <string.h> and the u8..u64 typedefs.
+//
+// Every debug_fmt call site owns a constexpr LogSite: the format string is parsed at compile time into one 4-bit kind
+// per argument, so the hot path only stores the raw 64-bit arguments (and copies strings, which would not outlive the
+// call). Formatting happens later, on the log thread or in the decoder.
+
+enum : u8
+{
+    LogArgInt = 1,
+    LogArgUnsigned32, // unsigned conversion without a length modifier, printed from the low half
+    LogArgDouble,
+    LogArgString,
+    LogArgStringBounded, // %.*s, the preceding int argument bounds the copy
+    LogArgPointer,
+};
+
+typedef struct
+{
+    const char* fmt;
+    const char* file;
+    u32 line;
+    u32 argCount;
+    u64 kinds; // LogArg per argument, 4 bits each, first argument in the low bits
+} LogSite;
+
+#define log_kind(kinds, i) ((u8)(((kinds) >> (4 * (i))) & 0xF))
+
+static constexpr bool log_is_one_of(char c, const char* set)
+{
+    for (; *set; ++set)
+        if (*set == c)
+            return true;
+    return false;
+}
+
+static constexpr LogSite log_site(const char* fmt, const char* file, u32 line)
+{
+    LogSite site = {fmt, file, line, 0, 0};
+    auto add = [&site](u8 kind) { site.kinds |= (u64)kind << (4 * site.argCount++); };
+
+    for (const char* p = fmt; *p; ++p)
+    {
+        if (*p != '%')
+            continue;
+        if (*++p == '%')
+            continue;
+
+        while (log_is_one_of(*p, "-+ #0"))
+            ++p;
+        if (*p == '*')
+        {
+            add(LogArgInt);
+            ++p;
+        }
+        while (*p >= '0' && *p <= '9')
+            ++p;
+
+        bool boundedPrecision = false;
+        if (*p == '.')
+        {
+            if (*++p == '*')
+            {
+                add(LogArgInt);
+                boundedPrecision = true;
+                ++p;
+            }
+            while (*p >= '0' && *p <= '9')
+                ++p;
+        }
+
+        bool lengthModifier = false;
+        while (log_is_one_of(*p, "hlLqjzt"))
+        {
+            lengthModifier = true;
+            ++p;
+        }
+
+        if (log_is_one_of(*p, "di"))
+            add(LogArgInt);
+        else if (log_is_one_of(*p, "uxXo"))
+            add(lengthModifier ? LogArgInt : LogArgUnsigned32);
+        else if (*p == 'c')
+            add(LogArgInt);
+        else if (log_is_one_of(*p, "fFeEgGaA"))
+            add(LogArgDouble);
+        else if (*p == 's')
+            add(boundedPrecision ? LogArgStringBounded : LogArgString);
+        else if (*p == 'p')
+            add(LogArgPointer);
+
+        if (!*p)
+            break;
+    }
+
+    return site;
+}
+
+// Layout of a binary log file: LogFileMagic, then a stream of records each starting with a LogRecord byte. A site is
+// defined once, before the first entry that refers to it; ids are only meaningful within one file.
+#define LogFileMagic "NYLALOG1"
+
+enum : u8
+{
+    LogRecordSite = 1,    // u64 id, u32 line, u64 kinds, u8 argCount, u16 fileLength, u16 fmtLength, file, fmt
+    LogRecordEntry = 2,   // u64 id, u64 CLOCK_MONOTONIC ns, u16 size, payload
+    LogRecordDropped = 3, // u64 entries lost to a full ring since the previous such record
+};
+
+// Payload of an entry: the arguments in order, 8 bytes each, strings as a u16 length and the bytes.
+
+// Renders one entry into out (always NUL-terminated, truncated to capacity) and returns the length.
+static u32 log_format(const char* fmt, u64 kinds, u32 argCount, const u8* payload, u32 size, char* out, u32 capacity)
+{
+    u32 length = 0;
+    u32 arg = 0;
+    const u8* end = payload + size;
+
+    auto put = [&](int n) {
+        if (n > 0)
+            length = length + n < capacity ? length + n : capacity - 1;
+    };
+    auto next_u64 = [&]() -> u64 {
+        u64 value = 0;
+        if (payload + 8 <= end)
+        {
+            memcpy(&value, payload, 8);
+            payload += 8;
+        }
+        ++arg;
+        return value;
+    };
+
+    out[0] = '\0';
+    for (const char* p = fmt; *p && length + 1 < capacity;)
+    {
+        if (*p != '%' || p[1] == '%')
+        {
+            out[length++] = *p;
+            out[length] = '\0';
+            p += *p == '%' ? 2 : 1;
+            continue;
+        }
+
+        // rebuild the conversion with our own argument widths: flags, width and precision as '*', then the conversion
+        char spec[16] = "%";
+        u32 specLength = 1;
+        int width = 0, precision = -1;
+
+        for (++p; log_is_one_of(*p, "-+ #0") && specLength < 8; ++p)
+            spec[specLength++] = *p;
+
+        if (*p == '*')
+        {
+            width = (int)next_u64();
+            ++p;
+        }
+        for (; *p >= '0' && *p <= '9'; ++p)
+            width = width * 10 + (*p - '0');
+
+        if (*p == '.')
+        {
+            precision = 0;
+            if (*++p == '*')
+            {
+                precision = (int)next_u64();
+                ++p;
+            }
+            for (; *p >= '0' && *p <= '9'; ++p)
+                precision = precision * 10 + (*p - '0');
+        }
+
+        while (log_is_one_of(*p, "hlLqjzt"))
+            ++p;
+        char conversion = *p;
+        if (conversion)
+            ++p;
+
+        spec[specLength++] = '*';
+        spec[specLength++] = '.';
+        spec[specLength++] = '*';
+
+        u8 kind = arg < argCount ? log_kind(kinds, arg) : 0;
+        char* cursor = out + length;
+        u32 room = capacity - length;
+
+        switch (kind)
+        {
+            case LogArgInt:
+            case LogArgUnsigned32:
+            {
+                u64 value = next_u64();
+                if (kind == LogArgUnsigned32)
+                    value &= 0xFFFFFFFF;
+
+                spec[specLength++] = 'l';
+                spec[specLength++] = 'l';
+                spec[specLength++] = conversion;
+                spec[specLength] = '\0';
+                if (conversion == 'c')
+                    put(snprintf(cursor, room, "%*c", width, (int)value));
+                else
+                    put(snprintf(cursor, room, spec, width, precision, (unsigned long long)value));
+                break;
+            }
+
+            case LogArgDouble:
+            {
+                u64 bits = next_u64();
+                double value;
+                memcpy(&value, &bits, 8);
+
+                spec[specLength++] = conversion;
+                spec[specLength] = '\0';
+                put(snprintf(cursor, room, spec, width, precision, value));
+                break;
+            }
+
+            case LogArgString:
+            case LogArgStringBounded:
+            {
+                u16 stringLength = 0;
+                if (payload + 2 <= end)
+                {
+                    memcpy(&stringLength, payload, 2);
+                    payload += 2;
+                }
+                if (payload + stringLength > end)
+                    stringLength = end - payload;
+
+                spec[specLength++] = 's';
+                spec[specLength] = '\0';
+                put(snprintf(cursor, room, spec, width, (int)stringLength, (const char*)payload));
+                payload += stringLength;
+                ++arg;
+                break;
+            }
+
+            case LogArgPointer: put(snprintf(cursor, room, "%p", (void*)(uintptr_t)next_u64())); break;
+
+            default: put(snprintf(cursor, room, "%%%c", conversion)); break;
+        }
+    }
+
+    return length;
+}
@@ -0,0 +1,367 @@
+#include "nyla.hpp"
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+// Single epoll reactor. The X connection is drained before every wait, and whatever xcb read into its queues while
+// flushing or polling for replies sends the loop around again, so it only sleeps when xcb has nothing queued; timers,
+// signals and any other fds register as sources and are dispatched in batches from one epoll_wait.
+
+enum
+{
+    LoopSourceFd,
+    LoopSourceTimer,
+    LoopSourceSignal,
+};
+
+typedef struct
+{
+    int fd; // -1 when the source is free
+    u8 kind;
+    LoopCallback callback;
+    void* data;
+} LoopSource;
+
+static int loopFd = -1;
+static LoopSource loopSources[32];
+
+static xcb_generic_event_t* loopBatch[256];
+static xcb_generic_event_t* loopQueued; // taken off xcb's queue by the check before sleeping, dispatched first
+
+static struct
+{
+    u64 batches;
+    u64 events;
+    u64 merged;
+    u32 lastBatchEvents;
+    u32 lastBatchMerged;
+} loopStats;
+
+void loop_init()
+{
+    loopFd = epoll_create1(EPOLL_CLOEXEC);
+    assert(loopFd >= 0 && "could not create epoll instance");
+
+    for (auto& source : loopSources)
+        source.fd = -1;
+}
+
+// NULL when every slot is taken or epoll refuses the fd.
+static LoopSource* loop_try_add_source(int fd, u8 kind, u32 events, LoopCallback callback, void* data)
+{
+    LoopSource* source = NULL;
+    for (auto& it : loopSources)
+    {
+        if (it.fd == -1)
+        {
+            source = &it;
+            break;
+        }
+    }
+    if (!source)
+        return NULL;
+
+    *source = (LoopSource){.fd = fd, .kind = kind, .callback = callback, .data = data};
+
+    struct epoll_event ev = {.events = events, .data = {.ptr = source}};
+    if (epoll_ctl(loopFd, EPOLL_CTL_ADD, fd, &ev))
+    {
+        *source = (LoopSource){.fd = -1};
+        return NULL;
+    }
+
+    return source;
+}
+
+static LoopSource* loop_add_source(int fd, u8 kind, u32 events, LoopCallback callback, void* data)
+{
+    LoopSource* source = loop_try_add_source(fd, kind, events, callback, data);
+    assert(source && "could not add loop source");
+    return source;
+}
+
+// callback gets the epoll event mask. Returns false when the loop has no room for the fd, which callers adding fds
+// on behalf of somebody else (connections) have to handle; the fd is not closed.
+bool loop_add_fd(int fd, u32 events, LoopCallback callback, void* data)
+{
+    return loop_try_add_source(fd, LoopSourceFd, events, callback, data);
+}
+
+// Removing from inside a callback is fine, pending events of the removed source in the current batch are dropped.
+void loop_remove_fd(int fd)
+{
+    for (auto& source : loopSources)
+    {
+        if (source.fd == fd)
+        {
+            epoll_ctl(loopFd, EPOLL_CTL_DEL, fd, NULL);
+            if (source.kind != LoopSourceFd)
+                close(fd);
+            source = (LoopSource){.fd = -1};
+            return;
+        }
+    }
+}
+
+// Re-arms a timer from loop_add_timer; a zero initialNs disarms it.
+void loop_arm_timer(int fd, u64 initialNs, u64 intervalNs)
+{
+    struct itimerspec spec = {
+        .it_interval = {.tv_sec = (time_t)(intervalNs / 1000000000ull), .tv_nsec = (long)(intervalNs % 1000000000ull)},
+        .it_value = {.tv_sec = (time_t)(initialNs / 1000000000ull), .tv_nsec = (long)(initialNs % 1000000000ull)},
+    };
+    timerfd_settime(fd, 0, &spec, NULL);
+}
+
+// callback gets the number of expirations; a zero interval makes a one-shot timer. Returns the timerfd, which can be
+// re-armed with loop_arm_timer or passed to loop_remove_fd.
+int loop_add_timer(u64 initialNs, u64 intervalNs, LoopCallback callback, void* data)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    assert(fd >= 0 && "could not create timerfd");
+
+    loop_arm_timer(fd, initialNs, intervalNs);
+    loop_add_source(fd, LoopSourceTimer, EPOLLIN, callback, data);
+    return fd;
+}
+
+// Blocks signo for the whole process and delivers it through a signalfd instead; callback gets the signal number.
+// Blocked signals survive exec, spawned children have to unblock them.
+int loop_add_signal(int signo, LoopCallback callback, void* data)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, signo);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    assert(fd >= 0 && "could not create signalfd");
+
+    loop_add_source(fd, LoopSourceSignal, EPOLLIN, callback, data);
+    return fd;
+}
+
+static void loop_dispatch(LoopSource* source, u32 events)
+{
+    trace_span("loop source");
+    switch (source->kind)
+    {
+        case LoopSourceFd: source->callback(source->data, events); break;
+
+        case LoopSourceTimer:
+        {
+            u64 expirations;
+            if (read(source->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+                source->callback(source->data, expirations);
+            break;
+        }
+
+        case LoopSourceSignal:
+        {
+            struct signalfd_siginfo info[8];
+            ssize_t n = read(source->fd, info, sizeof(info));
+            for (ssize_t i = 0; i < n / (ssize_t)sizeof(*info); ++i)
+                source->callback(source->data, info[i].ssi_signo);
+            break;
+        }
+    }
+}
+
+static xcb_window_t coalesce_window(xcb_generic_event_t* e)
+{
+    switch (e->response_type & ~0x80)
+    {
+        case XCB_CONFIGURE_NOTIFY: return ((xcb_configure_notify_event_t*)e)->window;
+        case XCB_CONFIGURE_REQUEST: return ((xcb_configure_request_event_t*)e)->window;
+        case XCB_MOTION_NOTIFY: return ((xcb_motion_notify_event_t*)e)->event;
+        case XCB_UNMAP_NOTIFY: return ((xcb_unmap_notify_event_t*)e)->window;
+        case XCB_DESTROY_NOTIFY: return ((xcb_destroy_notify_event_t*)e)->window;
+        default: return XCB_NONE;
+    }
+}
+
+// Folds the fields an older ConfigureRequest sets and a newer one for the same window does not into the newer one.
+static void merge_configure_request(xcb_configure_request_event_t* newer, const xcb_configure_request_event_t* older)
+{
+    u16 missing = older->value_mask & ~newer->value_mask;
+    if (missing & XCB_CONFIG_WINDOW_X)
+        newer->x = older->x;
+    if (missing & XCB_CONFIG_WINDOW_Y)
+        newer->y = older->y;
+    if (missing & XCB_CONFIG_WINDOW_WIDTH)
+        newer->width = older->width;
+    if (missing & XCB_CONFIG_WINDOW_HEIGHT)
+        newer->height = older->height;
+    if (missing & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+        newer->border_width = older->border_width;
+    if (missing & XCB_CONFIG_WINDOW_SIBLING)
+        newer->sibling = older->sibling;
+    if (missing & XCB_CONFIG_WINDOW_STACK_MODE)
+        newer->stack_mode = older->stack_mode;
+    newer->value_mask |= missing;
+}
+
+// Drops events made redundant by a later event in the same batch, walking backwards so the survivor is always the
+// newest one and keeps its position:
+//  - only the last ConfigureNotify/ConfigureRequest per window is kept, handlers never look at intermediate geometry;
+//    fields an earlier ConfigureRequest set and the last one does not are merged into it, so a move and then a resize
+//    still do both
+//  - runs of MotionNotify on the same window collapse into the last one
+//  - an UnmapNotify is dropped when the window is destroyed later in the batch
+// Returns the number of dropped events; dropped entries are freed and set to NULL.
+static u32 coalesce_events(xcb_generic_event_t** batch, u32 count)
+{
+    struct
+    {
+        u8 type;
+        xcb_window_t win;
+        xcb_generic_event_t* event; // the surviving, newer one
+    } seen[std::size(loopBatch)];
+    u32 seenCount = 0;
+    u32 merged = 0;
+
+    xcb_generic_event_t* next = NULL;
+    for (u32 i = count; i-- > 0;)
+    {
+        xcb_generic_event_t* e = batch[i];
+        u8 type = e->response_type & ~0x80;
+        xcb_window_t win = coalesce_window(e);
+        if (!win)
+        {
+            next = e;
+            continue;
+        }
+
+        bool redundant = false;
+        switch (type)
+        {
+            case XCB_CONFIGURE_NOTIFY:
+            case XCB_CONFIGURE_REQUEST:
+            {
+                for (u32 j = 0; j < seenCount && !redundant; ++j)
+                {
+                    redundant = seen[j].type == type && seen[j].win == win;
+                    if (redundant && type == XCB_CONFIGURE_REQUEST)
+                        merge_configure_request((xcb_configure_request_event_t*)seen[j].event,
+                                                (xcb_configure_request_event_t*)e);
+                }
+                break;
+            }
+
+            case XCB_MOTION_NOTIFY:
+            {
+                redundant = next && (next->response_type & ~0x80) == XCB_MOTION_NOTIFY && coalesce_window(next) == win;
+                break;
+            }
+
+            case XCB_UNMAP_NOTIFY:
+            {
+                for (u32 j = 0; j < seenCount && !redundant; ++j)
+                    redundant = seen[j].type == XCB_DESTROY_NOTIFY && seen[j].win == win;
+                break;
+            }
+        }
+
+        if (redundant)
+        {
+            free(e);
+            batch[i] = NULL;
+            ++merged;
+            continue;
+        }
+
+        seen[seenCount++] = {.type = type, .win = win, .event = e};
+        next = e;
+    }
+
+    return merged;
+}
+
+// Reads and dispatches everything xcb has, in batches of up to std::size(loopBatch) events. Also picks up events xcb
+// queued while reading replies, which would never wake epoll.
+static void loop_drain_events(void (*dispatchEvent)(xcb_generic_event_t*))
+{
+    while (true)
+    {
+        u32 count = 0;
+        if (loopQueued)
+        {
+            loopBatch[count++] = loopQueued;
+            loopQueued = NULL;
+        }
+        while (count < std::size(loopBatch) && (loopBatch[count] = xcb_poll_for_event(conn)))
+            ++count;
+        if (!count)
+            break;
+
+        u32 merged = coalesce_events(loopBatch, count);
+        ++loopStats.batches;
+        loopStats.events += count;
+        loopStats.merged += merged;
+        loopStats.lastBatchEvents = count;
+        loopStats.lastBatchMerged = merged;
+        if (merged)
+            debug_fmt("batch: %u events, %u merged", count, merged);
+
+        for (u32 i = 0; i < count; ++i)
+        {
+            if (!loopBatch[i])
+                continue;
+
+            dispatchEvent(loopBatch[i]);
+            free(loopBatch[i]);
+        }
+    }
+}
+
+void loop_run(void (*dispatchEvent)(xcb_generic_event_t*))
+{
+    struct epoll_event events[16];
+    int xcbFd = xcb_get_file_descriptor(conn);
+    loop_add_fd(xcbFd, EPOLLIN, NULL, NULL); // only wakes the loop, events are drained at the top
+
+    watchdog_busy();
+    while (true)
+    {
+        // resumed tasks may have sent requests, and polling for their replies may read more events off the socket
+        {
+            trace_span("drain events");
+            do
+                loop_drain_events(dispatchEvent);
+            while (resume_replies());
+        }
+
+        if (xcb_connection_has_error(conn))
+        {
+            debug_fmt("X connection error %d", xcb_connection_has_error(conn));
+            exit(EXIT_FAILURE);
+        }
+
+        {
+            trace_span("xcb_flush");
+            xcb_flush(conn);
+        }
+
+        // the flush and the last resume_replies() can read events and replies off the socket into xcb's queues, after
+        // which the fd is no longer readable and epoll would not wake up for them
+        if (resume_replies() || (loopQueued = xcb_poll_for_queued_event(conn)))
+            continue;
+
+        int n;
+        {
+            trace_span("epoll_wait");
+            watchdog_idle();
+            n = epoll_wait(loopFd, events, std::size(events), -1);
+            watchdog_busy();
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            LoopSource* source = (LoopSource*)events[i].data.ptr;
+            if (source->fd == -1 || source->fd == xcbFd)
+                continue;
+
+            loop_dispatch(source, events[i].events);
+        }
+    }
+}
@@ -0,0 +1,161 @@
+#include "nyla.hpp"
+
+// Handler cost accounting per event type. dispatch_event already measures every handler in TSC cycles for the flight
+// recorder; the same numbers go into a log-linear (HDR style) histogram per event type, 16 sub-buckets per power of
+// two so any percentile is within 1/16 of the true value. Recording is a few adds, cycles are converted to time only
+// when the metrics are queried over the control socket. Requests and wire bytes per handler come from requests.cpp.
+
+enum : u32
+{
+    MetricsSubBits = 4,
+    MetricsSubBuckets = 1 << MetricsSubBits,
+    MetricsBuckets = (32 - MetricsSubBits + 1) * MetricsSubBuckets, // u32 cycle counts
+    MetricsExtensionEvents = std::size(coreEventNames), // every extension event shares the last slot
+    MetricsEventTypes,
+};
+
+typedef struct
+{
+    u64 count;
+    u64 cycles;
+    u64 requests;
+    u64 bytes; // on the wire
+    u32 maxCycles;
+    u32 histogram[MetricsBuckets];
+} HandlerMetrics;
+
+static struct
+{
+    HandlerMetrics handlers[MetricsEventTypes];
+    u64 tscStart;
+    u64 nsStart;
+} metrics;
+
+static inline u32 metrics_bucket(u32 value)
+{
+    if (value < MetricsSubBuckets)
+        return value;
+
+    u32 exponent = 31 - __builtin_clz(value);
+    return (exponent - MetricsSubBits + 1) * MetricsSubBuckets +
+           ((value >> (exponent - MetricsSubBits)) & (MetricsSubBuckets - 1));
+}
+
+// smallest value that lands in the bucket
+static u64 metrics_bucket_floor(u32 bucket)
+{
+    if (bucket < MetricsSubBuckets)
+        return bucket;
+
+    u32 exponent = bucket / MetricsSubBuckets + MetricsSubBits - 1;
+    return (u64)(MetricsSubBuckets + bucket % MetricsSubBuckets) << (exponent - MetricsSubBits);
+}
+
+static inline u32 metrics_event_slot(u8 responseType)
+{
+    u8 type = responseType & 0x7F;
+    return type < MetricsExtensionEvents ? type : MetricsExtensionEvents;
+}
+
+static inline void metrics_record_handler(u8 responseType, u32 cycles, u32 requests, u32 bytes)
+{
+    HandlerMetrics* handler = metrics.handlers + metrics_event_slot(responseType);
+    ++handler->count;
+    handler->cycles += cycles;
+    handler->requests += requests;
+    handler->bytes += bytes;
+    if (cycles > handler->maxCycles)
+        handler->maxCycles = cycles;
+    ++handler->histogram[metrics_bucket(cycles)];
+}
+
+// Upper edge of the bucket holding the given fraction of the samples.
+static u64 metrics_percentile(const HandlerMetrics* handler, double fraction)
+{
+    u64 rank = (u64)(handler->count * fraction);
+    u64 seen = 0;
+    for (u32 bucket = 0; bucket < MetricsBuckets; ++bucket)
+    {
+        seen += handler->histogram[bucket];
+        if (seen > rank)
+        {
+            u64 ceiling = bucket + 1 < MetricsBuckets ? metrics_bucket_floor(bucket + 1) - 1 : handler->maxCycles;
+            return ceiling < handler->maxCycles ? ceiling : handler->maxCycles;
+        }
+    }
+    return handler->maxCycles;
+}
+
+static double metrics_ticks_per_ns()
+{
+    u64 ns = now_ns() - metrics.nsStart;
+    return ns ? (double)(read_tsc() - metrics.tscStart) / (double)ns : 1.0;
+}
+
+void metrics_init()
+{
+    metrics.tscStart = read_tsc();
+    metrics.nsStart = now_ns();
+    wireStats.nsStart = metrics.nsStart;
+}
+
+void metrics_reset()
+{
+    for (auto& handler : metrics.handlers)
+        memset(&handler, 0, sizeof(handler));
+    zero_after(&wireStats, sent);
+    wireStats.nsStart = now_ns();
+}
+
+void metrics_report(IpcReply* reply, const char* extensionName)
+{
+    double usPerTick = 1.0 / metrics_ticks_per_ns() / 1e3;
+
+    ipc_printf(reply,
+               "%-18s %10s %9s %9s %9s %9s %10s %8s %8s\n",
+               "event",
+               "count",
+               "mean us",
+               "p50 us",
+               "p99 us",
+               "max us",
+               "total ms",
+               "req/evt",
+               "B/evt");
+
+    for (u32 slot = 0; slot < MetricsEventTypes; ++slot)
+    {
+        const HandlerMetrics* handler = metrics.handlers + slot;
+        if (!handler->count)
+            continue;
+
+        ipc_printf(reply,
+                   "%-18s %10llu %9.2f %9.2f %9.2f %9.2f %10.3f %8.2f %8.1f\n",
+                   slot < MetricsExtensionEvents ? coreEventNames[slot] : extensionName,
+                   (unsigned long long)handler->count,
+                   handler->cycles * usPerTick / handler->count,
+                   metrics_percentile(handler, 0.50) * usPerTick,
+                   metrics_percentile(handler, 0.99) * usPerTick,
+                   handler->maxCycles * usPerTick,
+                   handler->cycles * usPerTick / 1e3,
+                   (double)handler->requests / handler->count,
+                   (double)handler->bytes / handler->count);
+    }
+
+    double seconds = (now_ns() - wireStats.nsStart) / 1e9;
+    ipc_printf(reply, "\n%-30s %10s %12s %10s %10s\n", "request", "count", "bytes", "req/s", "B/s");
+    for (u32 kind = 0; kind < std::size(wireRequestNames); ++kind)
+    {
+        const WireTotals* totals = wireStats.requests + kind;
+        if (!totals->requests)
+            continue;
+
+        ipc_printf(reply,
+                   "%-30s %10llu %12llu %10.2f %10.1f\n",
+                   wireRequestNames[kind],
+                   (unsigned long long)totals->requests,
+                   (unsigned long long)totals->bytes,
+                   seconds > 0 ? totals->requests / seconds : 0.0,
+                   seconds > 0 ? totals->bytes / seconds : 0.0);
+    }
+}
@@ -1,408 +1,1645 @@
 #include "nyla.hpp"
+#include "log.cpp"
+#include "clients.cpp"
+#include "requests.cpp"
+#include "flight.cpp"
+#include "roundtrips.cpp"
+#include "async.cpp"
+#include "properties.cpp"
+#include "chords.cpp"
+#include "keymap.cpp"
+#include "handoff.cpp"
+#include "session.cpp"
+#include "watchdog.cpp"
+#include "loop.cpp"
+#include "ipc.cpp"
+#include "metrics.cpp"
+#include "counters.cpp"
+#include "trace.cpp"
 #include "overlay.cpp"
 
-enum
-{
-    ClientFlagMapped = 1
-};
+#define HANDLER(type) static void nyla_handle_##type(xcb_##type##_event_t* e)
+// event, handler, the window it is about for the flight recorder (ev is the typed event)
+#define EVENTS(X)                                                                                                      \
+    X(XCB_CREATE_NOTIFY, create_notify, ev->window)                                                                    \
+    X(XCB_DESTROY_NOTIFY, destroy_notify, ev->window)                                                                  \
+    X(XCB_CONFIGURE_REQUEST, configure_request, ev->window)                                                            \
+    X(XCB_CONFIGURE_NOTIFY, configure_notify, ev->window)                                                              \
+    X(XCB_MAP_REQUEST, map_request, ev->window)                                                                        \
+    X(XCB_MAP_NOTIFY, map_notify, ev->window)                                                                          \
+    X(XCB_MAPPING_NOTIFY, mapping_notify, XCB_NONE)                                                                    \
+    X(XCB_UNMAP_NOTIFY, unmap_notify, ev->window)                                                                      \
+    X(XCB_PROPERTY_NOTIFY, property_notify, ev->window)                                                                \
+    X(XCB_CLIENT_MESSAGE, client_message, ev->window)                                                                  \
+    X(XCB_KEY_PRESS, key_press, ev->child)                                                                             \
+    X(XCB_KEY_RELEASE, key_release, ev->child)                                                                         \
+    X(XCB_FOCUS_IN, focus_in, ev->event)                                                                               \
+    X(XCB_FOCUS_OUT, focus_out, ev->event)
 
-typedef struct
-{
-    xcb_window_t win;
-    u32 flags;
-} Client;
+static const char* termCommand[] = {"ghostty", NULL};
+// warm terminals kept unmapped for d+t, NYLA_TERMINAL_POOL=n keeps n of them (at most 8); off by default
+static u8 terminalPoolSize;
 
-#define ATOMS(X)                                                                                                       \
-    X(UTF8_STRING)                                                                                                     \
-    X(WM_NAME)                                                                                                         \
-    X(_NET_WM_NAME)
+#define ACTIONS(X)                                                                                                     \
+    X(swap_columns)                                                                                                    \
+    X(activate_first)                                                                                                  \
+    X(spawn_terminal)                                                                                                  \
+    X(toggle_column)                                                                                                   \
+    X(restart)                                                                                                         \
+    X(quit)
 
-#define X(atom) static xcb_atom_t ATOM_##atom;
-ATOMS(X)
+enum
+{
+    ActionNone,
+#define X(name) Action_##name,
+    ACTIONS(X)
 #undef X
+};
 
-#define HANDLER(type) static void nyla_handle_##type(xcb_##type##_event_t* e)
-#define EVENTS(X)                                                                                                      \
-    X(XCB_CREATE_NOTIFY, create_notify)                                                                                \
-    X(XCB_DESTROY_NOTIFY, destroy_notify)                                                                              \
-    X(XCB_CONFIGURE_REQUEST, configure_request)                                                                        \
-    X(XCB_CONFIGURE_NOTIFY, configure_notify)                                                                          \
-    X(XCB_MAP_REQUEST, map_request)                                                                                    \
-    X(XCB_MAP_NOTIFY, map_notify)                                                                                      \
-    X(XCB_MAPPING_NOTIFY, mapping_notify)                                                                              \
-    X(XCB_UNMAP_NOTIFY, unmap_notify)                                                                                  \
-    X(XCB_CLIENT_MESSAGE, client_message)                                                                              \
-    X(XCB_KEY_PRESS, key_press)                                                                                        \
-    X(XCB_KEY_RELEASE, key_release)                                                                                    \
-    X(XCB_FOCUS_IN, focus_in)                                                                                          \
-    X(XCB_FOCUS_OUT, focus_out)
-
-// clang-format off
-#define KEYS(X) \
-    X(q, 0) X(w, 0) X(e, 0) X(r, 0) X(t, 0) \
-    X(a, 0) X(s, 1) X(d, 1) X(f, 0) X(g, 0) \
-    X(z, 0) X(x, 0) X(c, 0) X(v, 0) X(b, 0)
-// clang-format on
-
-#define X(key, grabbed) static xcb_keycode_t key##Keycode;
-KEYS(X)
-#undef X
+// keys, length, action, timeout in ms for the keys in between
+static constexpr ChordBinding bindings[] = {
+    {{Key_d, Key_x}, 2, Action_swap_columns, 0},
+    {{Key_d, Key_f}, 2, Action_activate_first, 0},
+    {{Key_d, Key_t}, 2, Action_spawn_terminal, 0},
+    {{Key_s, Key_f}, 2, Action_toggle_column, 0},
+    {{Key_s, Key_r}, 2, Action_restart, 0},
+    {{Key_s, Key_q}, 2, Action_quit, 0},
+};
 
-static const char* termCommand[] = {"ghostty", NULL};
+static constexpr ChordTrie chordTrie = build_chord_trie(bindings);
+static_assert(chordTrie.valid, "conflicting or too many chord bindings");
 
 static const char** argv;
-int logFd;
 Display* dpy;
 xcb_connection_t* conn;
 xcb_screen_t* screen;
 
-static Client clients[64];
+#define X(atom) xcb_atom_t ATOM_##atom;
+ATOMS(X)
+#undef X
+
 static xcb_keycode_t chordKey;
+static u8 chordNode;
+static int chordTimer;
 xcb_window_t overlayWindow;
 static u8 activeCol = 0;
 
-enum
+static ClientHandle activeClients[2];
+static xcb_window_t focusedWindow;
+
+static struct
+{
+    u64 sent;
+    u64 suppressed;
+} arrangeStats;
+
+// Logs the cached window name, loading it first when it is not cached yet (both requests go out before the wait).
+Task log_client_name(const char* what, ClientHandle handle)
+{
+    prefetch_client_properties(handle, (1u << ClientPropertyNetWmName) | (1u << ClientPropertyWmName));
+    co_await await_client_property(handle, ClientPropertyNetWmName);
+    co_await await_client_property(handle, ClientPropertyWmName);
+
+    Client* client = get_client(handle);
+    if (!client)
+        co_return;
+
+    const char* name;
+    u32 length;
+    if (!get_client_name(handle, &name, &length) || !length)
+    {
+        name = "(no name)";
+        length = strlen(name);
+    }
+    debug_fmt("%s %#x %.*s", what, client->win, (int)strnlen(name, length), name);
+}
+
+// posix_spawn uses clone(CLONE_VM | CLONE_VFORK) in glibc, so unlike fork() it does not have to copy the page tables
+// of everything the EGL driver mapped into us. The child gets /dev/null for stdio, its own session, an empty signal
+// mask (ours blocks the signals routed through signalfd) and default SIGCHLD handling.
+pid_t spawn(const char* const command[])
+{
+    u64 start = now_ns();
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addclose(&actions, xcb_get_file_descriptor(conn));
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+
+    pid_t pid;
+    int err = posix_spawnp(&pid, command[0], &actions, &attr, (char* const*)command, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err)
+    {
+        debug_fmt("could not spawn %s: %s", command[0], strerror(err));
+        return -1;
+    }
+
+    debug_fmt("spawned %s (%d) in %.3fms", command[0], pid, ns_to_ms(now_ns() - start));
+    return pid;
+}
+
+// Warm terminal pool. Pool terminals are launched in the background and recognized by _NET_WM_PID when they ask to be
+// mapped; instead of mapping them they are parked in ready until d+t hands one out into the active column. A terminal
+// that forks away from the launched pid is simply not recognized and shows up like any other window.
+
+typedef struct
+{
+    ClientHandle handle;
+    pid_t pid;
+} PooledTerminal;
+
+static struct
+{
+    pid_t pending[8]; // launched, window not seen yet
+    u8 pendingCount;
+    PooledTerminal ready[8];
+    u8 readyCount;
+    int refillTimer;
+    u8 failures; // pool terminals in a row that exited before showing a window
+
+    // cold launches from d+t, to attribute press->visible latency to their window
+    struct
+    {
+        pid_t pid;
+        u64 pressedAt;
+    } launched[4];
+    u8 launchedNext;
+} terminalPool;
+
+// [0] cold launch, [1] handed out from the pool
+static struct
+{
+    u64 hits;
+    u64 misses;
+    u64 visibleCount[2];
+    u64 visibleNs[2];
+} terminalPoolStats;
+
+enum : u8
 {
-    ActiveClientUnset = 0xFF
+    TerminalPoolMaxFailures = 5,
 };
-static u8 activeClients[2];
 
-char* get_window_name(xcb_window_t win)
+void refill_terminal_pool(void* data, u64 expirations)
+{
+    while (terminalPool.pendingCount + terminalPool.readyCount < terminalPoolSize)
+    {
+        pid_t pid = spawn(termCommand);
+        if (pid < 0)
+            break;
+        terminalPool.pending[terminalPool.pendingCount++] = pid;
+    }
+}
+
+bool take_pending_terminal(pid_t pid)
+{
+    for (u8 i = 0; i < terminalPool.pendingCount; ++i)
+    {
+        if (terminalPool.pending[i] == pid)
+        {
+            terminalPool.pending[i] = terminalPool.pending[--terminalPool.pendingCount];
+            return true;
+        }
+    }
+    return false;
+}
+
+ClientHandle take_pooled_terminal()
+{
+    while (terminalPool.readyCount)
+    {
+        ClientHandle handle = terminalPool.ready[--terminalPool.readyCount].handle;
+        Client* client = get_client(handle);
+        if (client && (client->flags & ClientFlagPooled))
+            return handle;
+    }
+    return ClientHandleNull;
+}
+
+// Drops a ready terminal whose window or process went away, so it stops counting against the pool size, and schedules
+// a replacement.
+void forget_pooled_terminal(ClientHandle handle, pid_t pid)
+{
+    for (u8 i = 0; i < terminalPool.readyCount; ++i)
+    {
+        if (terminalPool.ready[i].handle == handle || (pid && terminalPool.ready[i].pid == pid))
+        {
+            terminalPool.ready[i] = terminalPool.ready[--terminalPool.readyCount];
+            loop_arm_timer(terminalPool.refillTimer, 100 * 1000000ull, 0);
+            return;
+        }
+    }
+}
+
+void kill_terminal_pool()
+{
+    for (u8 i = 0; i < terminalPool.pendingCount; ++i)
+        kill(terminalPool.pending[i], SIGTERM);
+    for (u8 i = 0; i < terminalPool.readyCount; ++i)
+        if (get_client(terminalPool.ready[i].handle))
+            kill(terminalPool.ready[i].pid, SIGTERM);
+}
+
+// A pool terminal exited before it showed a window: it could not start, or it handed the window to an instance that
+// was already running and exited. Retries back off from 200ms, after TerminalPoolMaxFailures in a row the pool is off.
+static void terminal_pool_failed(pid_t pid)
+{
+    u8 failures = ++terminalPool.failures;
+    if (failures >= TerminalPoolMaxFailures)
+    {
+        debug_fmt("terminal pool: %u terminals in a row exited before showing a window, pool turned off", failures);
+        terminalPoolSize = 0;
+        return;
+    }
+
+    u64 delayNs = (100 * 1000000ull) << failures;
+    debug_fmt("terminal pool: %d exited before showing a window, retrying in %.0fms", pid, ns_to_ms(delayNs));
+    loop_arm_timer(terminalPool.refillTimer, delayNs, 0);
+}
+
+void reap_children(void* data, u64 signo)
+{
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+    {
+        // a pool terminal that died, before showing a window or while waiting unmapped, has to be replaced
+        if (take_pending_terminal(pid))
+            terminal_pool_failed(pid);
+        else
+            forget_pooled_terminal(ClientHandleNull, pid);
+    }
+}
+
+void focus_window(Client* client)
+{
+    if (focusedWindow != client->win)
+    {
+        xcb_tracked(xcb_set_input_focus, XCB_INPUT_FOCUS_POINTER_ROOT, client->win, XCB_CURRENT_TIME);
+        focusedWindow = client->win;
+        ++arrangeStats.sent;
+    }
+    else
+    {
+        ++arrangeStats.suppressed;
+    }
+
+    if (client->borderWidth != 2)
+    {
+        xcb_tracked(xcb_configure_window, client->win, XCB_CONFIG_WINDOW_BORDER_WIDTH, (u32[]){2});
+        client->borderWidth = 2;
+        ++arrangeStats.sent;
+    }
+    else
+    {
+        ++arrangeStats.suppressed;
+    }
+}
+
+// Sends only the fields that differ from what the server already has, nothing at all when the client is in place.
+void configure_client(Client* client, i16 x, i16 y, u16 width, u16 height, u8 stackMode)
+{
+    u32 values[5];
+    u32 count = 0;
+    u16 mask = 0;
+    bool geometryValid = client->flags & ClientFlagGeometryValid;
+
+    if (!geometryValid || client->x != x)
+    {
+        mask |= XCB_CONFIG_WINDOW_X;
+        values[count++] = (u32)(i32)x;
+    }
+    if (!geometryValid || client->y != y)
+    {
+        mask |= XCB_CONFIG_WINDOW_Y;
+        values[count++] = (u32)(i32)y;
+    }
+    if (!geometryValid || client->width != width)
+    {
+        mask |= XCB_CONFIG_WINDOW_WIDTH;
+        values[count++] = width;
+    }
+    if (!geometryValid || client->height != height)
+    {
+        mask |= XCB_CONFIG_WINDOW_HEIGHT;
+        values[count++] = height;
+    }
+    if (!(client->flags & ClientFlagStackValid) || client->stackMode != stackMode)
+    {
+        mask |= XCB_CONFIG_WINDOW_STACK_MODE;
+        values[count++] = stackMode;
+    }
+
+    if (!mask)
+    {
+        ++arrangeStats.suppressed;
+        return;
+    }
+
+    xcb_tracked(xcb_configure_window, client->win, mask, values);
+    ++arrangeStats.sent;
+
+    client->x = x;
+    client->y = y;
+    client->width = width;
+    client->height = height;
+    client->stackMode = stackMode;
+    client->flags |= ClientFlagGeometryValid | ClientFlagStackValid;
+    if (mask & ~XCB_CONFIG_WINDOW_STACK_MODE)
+        client->flags |= ClientFlagConfigured;
+}
+
+// ICCCM 4.1.5: a ConfigureRequest that results in no change still gets a (synthetic) ConfigureNotify
+void send_configure_notify(Client* client)
+{
+    xcb_configure_notify_event_t ev = {
+        .response_type = XCB_CONFIGURE_NOTIFY,
+        .event = client->win,
+        .window = client->win,
+        .above_sibling = XCB_NONE,
+        .x = client->x,
+        .y = client->y,
+        .width = client->width,
+        .height = client->height,
+        .border_width = client->borderWidth,
+        .override_redirect = 0,
+    };
+    xcb_tracked(xcb_send_event, 0, client->win, XCB_EVENT_MASK_STRUCTURE_NOTIFY, (const char*)&ev);
+}
+
+void park_window(xcb_window_t window)
+{
+    if (Client* client = find_client(window))
+    {
+        configure_client(client, screen->width_in_pixels, 0, 20, 20, XCB_STACK_MODE_BELOW);
+        return;
+    }
+
+    xcb_tracked(xcb_configure_window,
+                window,
+                (XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT |
+                 XCB_CONFIG_WINDOW_STACK_MODE),
+                (u32[]){screen->width_in_pixels, 0, 20, 20, XCB_STACK_MODE_BELOW});
+}
+
+// Grabs the first key of every binding among the changed keys, releasing the grab on their old keycodes first.
+void grab_chord_keys(u32 changed, const xcb_keycode_t* oldKeycodes)
+{
+    for (u8 key = 0; key < KeyCount; ++key)
+        if ((changed & (1u << key)) && chordTrie.next[0][key] && oldKeycodes[key])
+            xcb_tracked(xcb_ungrab_key, oldKeycodes[key], screen->root, XCB_MOD_MASK_4);
+
+    for (u8 key = 0; key < KeyCount; ++key)
+    {
+        if (!(changed & (1u << key)) || !chordTrie.next[0][key] || !keycodes[key])
+            continue;
+
+        xcb_tracked(xcb_grab_key,
+                    0,
+                    screen->root,
+                    XCB_MOD_MASK_4,
+                    keycodes[key],
+                    XCB_GRAB_MODE_ASYNC,
+                    XCB_GRAB_MODE_ASYNC);
+    }
+}
+
+// Loads the whole keymap, blocking; only used at startup.
+void map_keyboard()
+{
+    const xcb_setup_t* setup = xcb_get_setup(conn);
+    u32 count = setup->max_keycode - setup->min_keycode + 1;
+    xcb_reply_var(reply, xcb_get_keyboard_mapping, setup->min_keycode, count);
+
+    xcb_keycode_t oldKeycodes[KeyCount] = {};
+    u32 changed = store_keymap(reply, setup->min_keycode, count, oldKeycodes);
+    free(reply);
+
+    grab_chord_keys(changed, oldKeycodes);
+    build_chord_table(chordTrie);
+}
+
+// Refetches only the changed keycode range; grabs and the chord table are touched only if one of KEYS moved.
+Task remap_keyboard(xcb_keycode_t first, u32 count)
+{
+    xcb_get_keyboard_mapping_reply_t* reply = co_await xcb_async(xcb_get_keyboard_mapping, first, count);
+
+    xcb_keycode_t oldKeycodes[KeyCount] = {};
+    u32 changed = store_keymap(reply, first, count, oldKeycodes);
+    free(reply);
+
+    if (!changed)
+        co_return;
+
+    debug_fmt("keymap change moved keys %#x", changed);
+    grab_chord_keys(changed, oldKeycodes);
+    build_chord_table(chordTrie);
+}
+
+void arrange()
+{
+    trace_span("arrange");
+    for (uint i = 0; i < std::size(activeClients); ++i)
+    {
+        Client* client = get_client(activeClients[i]);
+        if (!client)
+            continue;
+
+        configure_client(client,
+                         screen->width_in_pixels / 2 * i,
+                         0,
+                         screen->width_in_pixels / 2,
+                         screen->height_in_pixels,
+                         XCB_STACK_MODE_ABOVE);
+
+        if (!(client->flags & (ClientFlagMapped | ClientFlagMapSent)))
+        {
+            xcb_tracked(xcb_map_window, client->win);
+            client->flags |= ClientFlagMapSent;
+            ++arrangeStats.sent;
+        }
+        else
+        {
+            ++arrangeStats.suppressed;
+        }
+    }
+
+    Client* focused = get_client(activeClients[activeCol]);
+    if (!focused)
+        focused = get_client(activeClients[!activeCol]);
+    if (focused)
+        focus_window(focused);
+
+    session_note_layout(activeClients, std::size(activeClients), activeCol);
+}
+
+// Serializes layout, client state and the terminal pool for the next image. Property caches are not carried over,
+// they reload lazily.
+int save_state()
+{
+    u32 size = sizeof(HandoffHeader) + clientCount * sizeof(HandoffClient);
+    HandoffHeader* header = (HandoffHeader*)calloc(1, size);
+    HandoffClient* records = (HandoffClient*)(header + 1);
+
+    *header = (HandoffHeader){
+        .magic = HandoffMagic,
+        .version = HandoffVersion,
+        .size = size,
+        .clientCount = clientCount,
+        .activeClients = {HandoffNone, HandoffNone},
+        .focusedWindow = focusedWindow,
+        .activeCol = activeCol,
+        .poolPendingCount = terminalPool.pendingCount,
+    };
+    memcpy(header->poolPending, terminalPool.pending, sizeof(terminalPool.pending));
+
+    for (u32 i = 0; i < clientCount; ++i)
+    {
+        Client* client = clients + i;
+        records[i] = (HandoffClient){
+            .win = client->win,
+            .flags = client->flags &
+                     (ClientFlagMapped | ClientFlagGeometryValid | ClientFlagStackValid | ClientFlagFloating),
+            .x = client->x,
+            .y = client->y,
+            .width = client->width,
+            .height = client->height,
+            .borderWidth = client->borderWidth,
+            .stackMode = client->stackMode,
+        };
+    }
+
+    for (u8 i = 0; i < terminalPool.readyCount; ++i)
+    {
+        Client* client = get_client(terminalPool.ready[i].handle);
+        if (client && (client->flags & ClientFlagPooled))
+            records[client - clients].poolPid = terminalPool.ready[i].pid;
+    }
+
+    for (u32 col = 0; col < std::size(activeClients); ++col)
+        if (Client* client = get_client(activeClients[col]))
+            header->activeClients[col] = client - clients;
+
+    int fd = handoff_write(header, size);
+    free(header);
+    return fd;
+}
+
+// Drops clients that went away while we were restarting and adopts windows that appeared meanwhile. Runs in the
+// background, the restored layout is already live.
+Task reconcile_clients()
+{
+    xcb_query_tree_reply_t* tree = co_await xcb_async(xcb_query_tree, screen->root);
+    if (!tree)
+        co_return;
+
+    xcb_window_t* children = xcb_query_tree_children(tree);
+    int count = xcb_query_tree_children_length(tree);
+
+    for (u32 i = 0; i < clientCount;)
+    {
+        bool alive = false;
+        for (int j = 0; j < count && !alive; ++j)
+            alive = children[j] == clients[i].win;
+
+        if (alive)
+        {
+            ++i;
+            continue;
+        }
+
+        debug_fmt("restored client %#x is gone", clients[i].win);
+        release_client_properties(clients + i);
+        remove_client(clients[i].win);
+    }
+
+    xcb_window_t* unknown = (xcb_window_t*)malloc(sizeof(xcb_window_t) * count);
+    xcb_get_window_attributes_cookie_t* cookies =
+        (xcb_get_window_attributes_cookie_t*)malloc(sizeof(xcb_get_window_attributes_cookie_t) * count);
+    int unknownCount = 0;
+    for (int j = 0; j < count; ++j)
+    {
+        if (children[j] == overlayWindow || find_client(children[j]))
+            continue;
+
+        unknown[unknownCount] = children[j];
+        cookies[unknownCount++] = xcb_send(xcb_get_window_attributes, children[j]);
+    }
+    free(tree);
+
+    for (int j = 0; j < unknownCount; ++j)
+    {
+        xcb_get_window_attributes_reply_t* attributes = co_await xcb_await(xcb_get_window_attributes, cookies[j]);
+        if (attributes && !attributes->override_redirect)
+        {
+            debug_fmt("adopting %#x created during restart", unknown[j]);
+            ClientHandle handle = add_client(unknown[j]);
+            if (attributes->map_state == XCB_MAP_STATE_VIEWABLE)
+            {
+                // it went on top of the stack we handed over
+                for (u32 i = 0; i < clientCount; ++i)
+                    clients[i].flags &= ~ClientFlagStackValid;
+                get_client(handle)->flags |= ClientFlagMapped;
+            }
+            watch_client(unknown[j]);
+        }
+        free(attributes);
+    }
+
+    free(cookies);
+    free(unknown);
+}
+
+// Resumes the layout of the previous image without any round trip. Returns false when there is no usable state.
+bool restore_state()
+{
+    u32 size;
+    const HandoffHeader* header = handoff_read(&size);
+    if (!header)
+        return false;
+
+    const HandoffClient* records = (const HandoffClient*)(header + 1);
+    ClientHandle* handles = (ClientHandle*)malloc(sizeof(ClientHandle) * (header->clientCount + 1));
+
+    for (u32 i = 0; i < header->clientCount; ++i)
+    {
+        const HandoffClient* record = records + i;
+        handles[i] = add_client(record->win);
+
+        Client* client = get_client(handles[i]);
+        client->flags = record->flags;
+        client->x = record->x;
+        client->y = record->y;
+        client->width = record->width;
+        client->height = record->height;
+        client->borderWidth = record->borderWidth;
+        client->stackMode = record->stackMode;
+        watch_client(record->win);
+
+        if (record->poolPid && terminalPool.readyCount < std::size(terminalPool.ready))
+        {
+            client->flags |= ClientFlagPooled;
+            terminalPool.ready[terminalPool.readyCount++] = {.handle = handles[i], .pid = record->poolPid};
+        }
+    }
+
+    for (u32 col = 0; col < std::size(activeClients); ++col)
+    {
+        u32 index = header->activeClients[col];
+        activeClients[col] = index < header->clientCount ? handles[index] : ClientHandleNull;
+    }
+    activeCol = header->activeCol & 1;
+    focusedWindow = header->focusedWindow;
+
+    if (header->poolPendingCount <= std::size(terminalPool.pending))
+        terminalPool.pendingCount = header->poolPendingCount;
+    memcpy(terminalPool.pending, header->poolPending, sizeof(terminalPool.pending));
+
+    debug_fmt("restored %u clients", header->clientCount);
+
+    free(handles);
+    handoff_release(header, size);
+
+    arrange();
+    reconcile_clients();
+    return true;
+}
+
+void restart()
+{
+    char value[32];
+    snprintf(value, sizeof(value), "%llu", (unsigned long long)now_ns());
+    setenv("NYLA_RESTART_NS", value, 1);
+
+    int stateFd = save_state();
+    if (stateFd >= 0)
+    {
+        snprintf(value, sizeof(value), "%d", stateFd);
+        setenv("NYLA_STATE_FD", value, 1);
+    }
+
+    close(xcb_get_file_descriptor(conn));
+    log_flush();
+    execv(argv[0], (char**)argv);
+    exit(EXIT_FAILURE);
+}
+
+// With recover set, puts the windows that survived a crash back into their columns in one pass over the session file.
+// Either way the session learns about every client it does not know yet.
+void restore_session(bool recover)
+{
+    if (recover)
+    {
+        u64 start = now_ns();
+
+        ClientHandle columns[std::size(activeClients)] = {};
+        u8 col = activeCol;
+        u32 restored = session_restore(columns, std::size(columns), &col);
+        if (restored)
+        {
+            // whatever the scan put into the columns makes room
+            for (ClientHandle handle : activeClients)
+            {
+                Client* client = get_client(handle);
+                if (client && handle != columns[0] && handle != columns[1])
+                    park_window(client->win);
+            }
+
+            memcpy(activeClients, columns, sizeof(activeClients));
+            activeCol = col & 1;
+        }
+
+        // the warm terminals of the crashed instance are still waiting unmapped, they go back into the pool
+        for (u32 i = 0; i < clientCount; ++i)
+        {
+            Client* client = clients + i;
+            if (!(client->flags & ClientFlagPooled))
+                continue;
+
+            const char* value;
+            u32 length;
+            ClientHandle handle = get_client_handle(i);
+            if (!(client->flags & ClientFlagMapped) && terminalPool.readyCount < terminalPoolSize &&
+                get_client_property(handle, ClientPropertyNetWmPid, &value, &length) && length >= 4)
+            {
+                terminalPool.ready[terminalPool.readyCount++] = {.handle = handle,
+                                                                 .pid = (pid_t)property_u32(value, 0)};
+            }
+            else
+            {
+                // a hidden terminal nobody will hand out (pool full or turned off) would only leak
+                if (!(client->flags & ClientFlagMapped) &&
+                    get_client_property(handle, ClientPropertyNetWmPid, &value, &length) && length >= 4)
+                    kill((pid_t)property_u32(value, 0), SIGTERM);
+                client->flags &= ~ClientFlagPooled;
+            }
+        }
+
+        debug_fmt("recovered %u columns and %u pooled terminals from the session snapshot in %.3fms",
+                  restored,
+                  terminalPool.readyCount,
+                  ns_to_ms(now_ns() - start));
+    }
+
+    for (u32 i = 0; i < clientCount; ++i)
+        session_note_client(get_client_handle(i));
+
+    arrange();
+}
+
+// windows of a crashed session that come back later than this do not get their old place
+static const u64 sessionRestoreWindowNs = 30 * 1000000000ull;
+static int sessionOrphanTimer;
+
+void expire_session_orphans(void* data, u64 expirations)
+{
+    session_expire_orphans();
+    loop_remove_fd(sessionOrphanTimer);
+}
+
+bool is_client_active(ClientHandle handle)
+{
+    if (!handle)
+        return false;
+
+    for (uint i = 0; i < std::size(activeClients); ++i)
+        if (activeClients[i] == handle)
+            return true;
+    return false;
+}
+
+// What placement needs to know about a window. Sent at CreateNotify so the answers are usually in the cache by the
+// time the MapRequest arrives.
+enum : u32
+{
+    PlacementProperties = (1u << ClientPropertyWmClass) | (1u << ClientPropertyWmNormalHints) |
+                          (1u << ClientPropertyWmTransientFor) | (1u << ClientPropertyNetWmWindowType) |
+                          (1u << ClientPropertyNetWmPid)
+};
+
+// NYLA_PREFETCH=0 or 'prefetch off' turns it off to compare
+static bool prefetchOnCreate = true;
+
+// [0] had to fetch at MapRequest, [1] everything was prefetched
+static struct
+{
+    u64 count[2];
+    u64 totalNs[2]; // MapRequest to decision
+    u64 maxNs[2];
+    u64 totalCreateNs[2]; // CreateNotify to decision
+    u64 maxCreateNs[2];
+} placementStats;
+
+bool wants_floating(ClientHandle handle)
+{
+    const char* value;
+    u32 length;
+
+    if (get_client_property(handle, ClientPropertyWmTransientFor, &value, &length) && length >= 4 &&
+        property_u32(value, 0))
+        return true;
+
+    if (get_client_property(handle, ClientPropertyNetWmWindowType, &value, &length))
+    {
+        for (u32 i = 0; i < length / 4; ++i)
+        {
+            xcb_atom_t type = property_u32(value, i);
+            if (type == ATOM__NET_WM_WINDOW_TYPE_DIALOG || type == ATOM__NET_WM_WINDOW_TYPE_UTILITY ||
+                type == ATOM__NET_WM_WINDOW_TYPE_TOOLBAR || type == ATOM__NET_WM_WINDOW_TYPE_SPLASH ||
+                type == ATOM__NET_WM_WINDOW_TYPE_MENU || type == ATOM__NET_WM_WINDOW_TYPE_DROPDOWN_MENU ||
+                type == ATOM__NET_WM_WINDOW_TYPE_POPUP_MENU || type == ATOM__NET_WM_WINDOW_TYPE_TOOLTIP ||
+                type == ATOM__NET_WM_WINDOW_TYPE_NOTIFICATION)
+                return true;
+        }
+    }
+
+    // fixed size: PMinSize and PMaxSize set with min == max
+    if (get_client_property(handle, ClientPropertyWmNormalHints, &value, &length) && length >= 9 * 4)
+    {
+        u32 flags = property_u32(value, 0);
+        u32 minWidth = property_u32(value, 5), minHeight = property_u32(value, 6);
+        u32 maxWidth = property_u32(value, 7), maxHeight = property_u32(value, 8);
+        if ((flags & 0x30) == 0x30 && minWidth && minWidth == maxWidth && minHeight == maxHeight)
+            return true;
+    }
+
+    return false;
+}
+
+Task place_and_map(ClientHandle handle)
+{
+    u64 start = now_ns();
+
+    // loads the prefetch has in flight are joined, not requested again; all missing ones go out before the first wait
+    Client* client = get_client(handle);
+    u32 missing = 0;
+    u32 fetched = 0;
+    for (u8 id = 0; id < ClientPropertyCount; ++id)
+    {
+        if (!(PlacementProperties & (1u << id)) || client->properties[id].state == PropertyValid)
+            continue;
+
+        missing |= 1u << id;
+        if (client->properties[id].state == PropertyUnloaded)
+        {
+            load_client_property(handle, id);
+            fetched |= 1u << id;
+        }
+    }
+
+    for (u8 id = 0; id < ClientPropertyCount; ++id)
+        if (missing & (1u << id))
+            co_await await_client_property(handle, id);
+
+    client = get_client(handle);
+    if (!client)
+        co_return;
+
+    const char* value;
+    u32 length;
+    pid_t pid = get_client_property(handle, ClientPropertyNetWmPid, &value, &length) && length >= 4
+                    ? (pid_t)property_u32(value, 0)
+                    : 0;
+
+    if (pid && take_pending_terminal(pid))
+    {
+        client->flags |= ClientFlagPooled;
+        terminalPool.ready[terminalPool.readyCount++] = {.handle = handle, .pid = pid};
+        terminalPool.failures = 0;
+        session_note_client(handle);
+        debug_fmt("pooled terminal %#x (%d)", client->win, pid);
+        co_return;
+    }
+
+    for (auto& launch : terminalPool.launched)
+    {
+        if (pid && launch.pid == pid)
+        {
+            client->requestedAt = launch.pressedAt;
+            launch.pid = 0;
+        }
+    }
+
+    if (wants_floating(handle))
+        client->flags |= ClientFlagFloating;
+
+    // a window coming back after a crash takes its old column if that is still empty
+    u8 column = session_claim(handle);
+    if (column < std::size(activeClients) && !get_client(activeClients[column]) &&
+        !(client->flags & ClientFlagFloating))
+    {
+        activeClients[column] = handle;
+        arrange();
+    }
+    else
+    {
+        xcb_tracked(xcb_map_window, client->win);
+    }
+    session_note_client(handle);
+
+    u64 end = now_ns();
+    u8 prefetched = !fetched;
+    placementStats.count[prefetched]++;
+    placementStats.totalNs[prefetched] += end - start;
+    if (end - start > placementStats.maxNs[prefetched])
+        placementStats.maxNs[prefetched] = end - start;
+    placementStats.totalCreateNs[prefetched] += end - client->createdAt;
+    if (end - client->createdAt > placementStats.maxCreateNs[prefetched])
+        placementStats.maxCreateNs[prefetched] = end - client->createdAt;
+
+    const char* wmClass = "";
+    u32 wmClassLength = 0;
+    get_client_property(handle, ClientPropertyWmClass, &wmClass, &wmClassLength);
+    debug_fmt("placed %#x %.*s%s: map->decision %.3fms, create->decision %.3fms, %s",
+              client->win,
+              (int)strnlen(wmClass, wmClassLength),
+              wmClass,
+              client->flags & ClientFlagFloating ? " floating" : "",
+              ns_to_ms(end - start),
+              ns_to_ms(end - client->createdAt),
+              prefetched ? "prefetched" : "fetched at map");
+}
+
+HANDLER(map_request)
+{
+    ClientHandle handle = find_client_handle(e->window);
+#ifndef NDEBUG
+    if (handle)
+        log_client_name("map request", handle);
+#endif
+
+    if (handle)
+        place_and_map(handle);
+    else
+        xcb_tracked(xcb_map_window, e->window);
+}
+
+HANDLER(map_notify)
+{
+    if (e->override_redirect)
+        return;
+
+    // whatever got mapped went on top of the stack
+    for (u32 i = 0; i < clientCount; ++i)
+        clients[i].flags &= ~ClientFlagStackValid;
+
+    Client* client = find_client(e->window);
+    if (!client)
+        return;
+
+    client->flags = (client->flags & ~ClientFlagMapSent) | ClientFlagMapped;
+
+    if (client->requestedAt)
+    {
+        u8 fromPool = !!(client->flags & ClientFlagFromPool);
+        u64 latency = now_ns() - client->requestedAt;
+        terminalPoolStats.visibleCount[fromPool]++;
+        terminalPoolStats.visibleNs[fromPool] += latency;
+        client->requestedAt = 0;
+
+        debug_fmt("terminal visible %.3fms after key press (%s), pool hit rate %llu/%llu",
+                  ns_to_ms(latency),
+                  fromPool ? "pool" : "cold",
+                  (unsigned long long)terminalPoolStats.hits,
+                  (unsigned long long)(terminalPoolStats.hits + terminalPoolStats.misses));
+    }
+}
+
+HANDLER(unmap_notify)
+{
+    ClientHandle handle = find_client_handle(e->window);
+    if (!handle)
+        return;
+
+    get_client(handle)->flags &= ~(ClientFlagMapped | ClientFlagMapSent);
+
+    for (auto& active : activeClients)
+    {
+        if (active == handle)
+        {
+            active = ClientHandleNull;
+            session_note_layout(activeClients, std::size(activeClients), activeCol);
+            break;
+        }
+    }
+}
+
+void action_swap_columns()
+{
+    xor_swap(activeClients[0], activeClients[1]);
+    arrange();
+}
+
+void action_activate_first()
+{
+    if (clientCount && !is_client_active(get_client_handle(0)))
+    {
+        clients[0].flags &= ~ClientFlagPooled;
+        session_note_client(get_client_handle(0));
+        activeClients[activeCol] = get_client_handle(0);
+        arrange();
+    }
+}
+
+void action_spawn_terminal()
+{
+    u64 pressedAt = now_ns();
+
+    if (ClientHandle handle = take_pooled_terminal())
+    {
+        ++terminalPoolStats.hits;
+
+        Client* client = get_client(handle);
+        client->flags = (client->flags & ~ClientFlagPooled) | ClientFlagFromPool;
+        client->requestedAt = pressedAt;
+        session_note_client(handle);
+        activeClients[activeCol] = handle;
+        arrange();
+    }
+    else
+    {
+        if (terminalPoolSize)
+            ++terminalPoolStats.misses;
+
+        pid_t pid = spawn(termCommand);
+        if (pid > 0)
+        {
+            terminalPool.launched[terminalPool.launchedNext] = {.pid = pid, .pressedAt = pressedAt};
+            terminalPool.launchedNext = (terminalPool.launchedNext + 1) % std::size(terminalPool.launched);
+        }
+    }
+
+    // while backing off the retry is already armed
+    if (terminalPoolSize && !terminalPool.failures)
+        loop_arm_timer(terminalPool.refillTimer, 100 * 1000000ull, 0);
+}
+
+void action_toggle_column()
+{
+    activeCol = !activeCol;
+    if (Client* client = get_client(activeClients[activeCol]))
+        focus_window(client);
+    session_note_layout(activeClients, std::size(activeClients), activeCol);
+}
+
+void action_restart()
+{
+    restart();
+}
+
+void action_quit()
 {
-    xcb_reply_var(reply, xcb_get_property, 0, win, ATOM__NET_WM_NAME, ATOM_UTF8_STRING, 0, 64);
-    if (!reply)
-        return NULL;
+    kill_terminal_pool();
+    session_close();
+    exit(EXIT_SUCCESS);
+}
 
-    int len = xcb_get_property_value_length(reply);
-    if (!len)
-    {
-        free(reply);
-        reply = xcb_reply(xcb_get_property, 0, win, ATOM_WM_NAME, XCB_ATOM_STRING, 0, 64);
-        if (!reply)
-            return NULL;
+static void (*const actions[])() = {
+    NULL,
+#define X(name) action_##name,
+    ACTIONS(X)
+#undef X
+};
 
-        len = xcb_get_property_value_length(reply);
-        if (!len)
-        {
-            free(reply);
-            return NULL;
-        }
-    }
+void reset_chord()
+{
+    chordKey = 0;
+    chordNode = 0;
+    loop_arm_timer(chordTimer, 0, 0);
+}
 
-    char* name = new char[len + 1];
-    memcpy(name, xcb_get_property_value(reply), len);
-    name[len] = '\0';
-    free(reply);
-    return name;
+void chord_timeout(void* data, u64 expirations)
+{
+    reset_chord();
 }
 
-void spawn(const char* const command[])
+HANDLER(key_press)
 {
-    if (fork() != 0)
+    u8 entry = chordTable[chordNode][e->detail];
+    if (!entry)
         return;
 
-    close(xcb_get_file_descriptor(conn));
-
-    int devNull = open("/dev/null", O_RDONLY);
-    dup2(devNull, STDIN_FILENO);
-    close(devNull);
-
-    devNull = open("/dev/null", O_WRONLY);
-    dup2(devNull, STDOUT_FILENO);
-    dup2(devNull, STDERR_FILENO);
-    close(devNull);
-
-    setsid();
+    if (entry & ChordEntryAction)
+    {
+        actions[entry & ~ChordEntryAction]();
+        return;
+    }
 
-    struct sigaction sa;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sa.sa_handler = SIG_DFL;
-    sigaction(SIGCHLD, &sa, NULL);
+    if (!chordNode)
+        chordKey = e->detail;
+    chordNode = entry;
 
-    execvp(command[0], (char**)command);
-    exit(EXIT_FAILURE);
+    if (chordTrie.timeoutMs[entry])
+        loop_arm_timer(chordTimer, chordTrie.timeoutMs[entry] * 1000000ull, 0);
 }
 
-void restart()
+HANDLER(key_release)
 {
-    close(xcb_get_file_descriptor(conn));
-    execv(argv[0], (char**)argv);
-    exit(EXIT_FAILURE);
+    if (e->detail == chordKey)
+        reset_chord();
 }
 
-void focus_window(xcb_window_t window)
+HANDLER(create_notify)
 {
-    xcb_set_input_focus(conn, XCB_INPUT_FOCUS_POINTER_ROOT, window, XCB_CURRENT_TIME);
-    xcb_configure_window(conn, window, XCB_CONFIG_WINDOW_BORDER_WIDTH, (u32[]){2});
+    if (e->override_redirect || e->parent != screen->root)
+        return;
+
+    ClientHandle handle = add_client(e->window);
+    get_client(handle)->createdAt = now_ns();
+    watch_client(e->window);
+    if (prefetchOnCreate)
+        prefetch_client_properties(handle, PlacementProperties);
 }
 
-void map_keyboard()
+HANDLER(destroy_notify)
 {
-    xcb_key_symbols_t* syms = xcb_key_symbols_alloc(conn);
+    debug_fmt("removing %dl", e->window);
 
-#define X(key, isGrabbed)                                                                                              \
-    do                                                                                                                 \
-    {                                                                                                                  \
-        xcb_keycode_t* keycodes = xcb_key_symbols_get_keycode(syms, XK_##key);                                         \
-        key##Keycode = *keycodes;                                                                                      \
-        free(keycodes);                                                                                                \
-        if (isGrabbed)                                                                                                 \
-            xcb_grab_key(                                                                                              \
-                conn, 0, screen->root, XCB_MOD_MASK_4, key##Keycode, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);        \
-    }                                                                                                                  \
-    while (false);
-    KEYS(X)
-#undef X
+    if (Client* client = find_client(e->window))
+    {
+        if (client->flags & ClientFlagPooled)
+            forget_pooled_terminal(find_client_handle(e->window), 0);
+        release_client_properties(client);
+    }
+    session_forget_window(e->window);
 
-    xcb_key_symbols_free(syms);
+    // handles to it in activeClients go stale and are skipped from now on
+    remove_client(e->window);
 }
 
-void arrange()
+HANDLER(configure_request)
 {
-    for (uint i = 0; i < std::size(activeClients); ++i)
+    ClientHandle handle = find_client_handle(e->window);
+    Client* floating = get_client(handle);
+    if (floating && (floating->flags & ClientFlagFloating))
     {
-        if (!activeClients[i])
-            continue;
-
-        Client* client = clients + activeClients[i];
-        xcb_configure_window(conn,
-                             client->win,
-                             (XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH |
-                              XCB_CONFIG_WINDOW_HEIGHT | XCB_CONFIG_WINDOW_STACK_MODE),
-                             (u32[]){screen->width_in_pixels / 2 * i,
-                                     0,
-                                     (u32)(screen->width_in_pixels / 2),
-                                     screen->height_in_pixels,
-                                     XCB_STACK_MODE_ABOVE});
-        xcb_map_window(conn, client->win);
-        focus_window(client->win);
+        u32 values[7];
+        u32 count = 0;
+        if (e->value_mask & XCB_CONFIG_WINDOW_X)
+            values[count++] = (u32)(i32)e->x;
+        if (e->value_mask & XCB_CONFIG_WINDOW_Y)
+            values[count++] = (u32)(i32)e->y;
+        if (e->value_mask & XCB_CONFIG_WINDOW_WIDTH)
+            values[count++] = e->width;
+        if (e->value_mask & XCB_CONFIG_WINDOW_HEIGHT)
+            values[count++] = e->height;
+        if (e->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+            values[count++] = e->border_width;
+        if (e->value_mask & XCB_CONFIG_WINDOW_SIBLING)
+            values[count++] = e->sibling;
+        if (e->value_mask & XCB_CONFIG_WINDOW_STACK_MODE)
+            values[count++] = e->stack_mode;
+
+        xcb_tracked(xcb_configure_window, e->window, e->value_mask, values);
+    }
+    else if (is_client_active(handle))
+    {
+        Client* client = get_client(handle);
+        client->flags &= ~ClientFlagConfigured;
+        arrange();
+        if (!(client->flags & ClientFlagConfigured))
+            send_configure_notify(client);
+    }
+    else
+    {
+        park_window(e->window);
     }
 }
 
-u8 is_client_active(int clientIndex)
-{
-    for (uint i = 0; i < std::size(activeClients); ++i)
-        if (activeClients[i] == clientIndex)
-            return true;
-    return false;
-}
+HANDLER(configure_notify) {}
 
-HANDLER(map_request)
+HANDLER(property_notify)
 {
-    xcb_map_window(conn, e->window);
+    invalidate_client_property(e->window, e->atom);
 }
 
-HANDLER(map_notify)
+HANDLER(client_message) {}
+
+HANDLER(mapping_notify)
 {
-    if (e->override_redirect)
+    // with XKB the same change also arrives as an XKB MapNotify, which is handled in dispatch_xkb_event
+    if (e->request != XCB_MAPPING_KEYBOARD || xkbAvailable)
         return;
 
-    for (auto& client : clients)
+    remap_keyboard(e->first_keycode, e->count);
+}
+
+void dispatch_xkb_event(xcb_generic_event_t* e)
+{
+    // every XKB event starts with response_type, xkbType, sequence, time and deviceID
+    switch (((xcb_xkb_map_notify_event_t*)e)->xkbType)
     {
-        if (client.win == e->window)
+        case XCB_XKB_MAP_NOTIFY:
+        {
+            xcb_xkb_map_notify_event_t* map = (xcb_xkb_map_notify_event_t*)e;
+            if (map->changed & XCB_XKB_MAP_PART_KEY_SYMS && map->nKeySyms)
+                remap_keyboard(map->firstKeySym, map->nKeySyms);
+            break;
+        }
+
+        case XCB_XKB_NEW_KEYBOARD_NOTIFY:
         {
-            client.flags |= ClientFlagMapped;
+            xcb_xkb_new_keyboard_notify_event_t* keyboard = (xcb_xkb_new_keyboard_notify_event_t*)e;
+            remap_keyboard(keyboard->minKeyCode, keyboard->maxKeyCode - keyboard->minKeyCode + 1);
             break;
         }
     }
 }
 
-HANDLER(unmap_notify)
+HANDLER(focus_in)
 {
-    for (uint i = 0; i < std::size(clients); ++i)
-    {
-        Client* client = clients + i;
+#if 0
+    if (activeClient)
+        nyla_focus_window(conn, activeClient->window);
+#endif
+}
 
-        if (client->win == e->window)
-        {
-            client->flags &= ~ClientFlagMapped;
+HANDLER(focus_out)
+{
+    xcb_tracked(xcb_configure_window, e->event, XCB_CONFIG_WINDOW_BORDER_WIDTH, (u32[]){0});
+    if (Client* client = find_client(e->event))
+        client->borderWidth = 0;
+    if (e->event == focusedWindow && e->mode == XCB_NOTIFY_MODE_NORMAL)
+        focusedWindow = XCB_NONE;
 
-            for (uint j = 0; j < std::size(activeClients); ++j)
-            {
-                if (activeClients[j] == i)
-                {
-                    activeClients[j] = 0;
-                    break;
-                }
-            }
-        }
-    }
+#if 0
+    if (activeClient)
+        nyla_focus_window(conn, activeClient->window);
+#endif
 }
 
-HANDLER(key_press)
+typedef struct
+{
+    const char* name;
+    u16 length;
+    xcb_atom_t* atom;
+} AtomName;
+
+static constexpr AtomName atomNames[] = {
+#define X(name) {#name, std::size(#name) - 1, &ATOM_##name},
+    ATOMS(X)
+#undef X
+};
+
+// Every cookie goes out before the first reply is read, one round trip however long ATOMS gets.
+void intern_atoms()
 {
-    if (!chordKey)
+    u64 start = now_ns();
+
+    xcb_intern_atom_cookie_t cookies[std::size(atomNames)];
+    for (u32 i = 0; i < std::size(atomNames); ++i)
+        cookies[i] = xcb_send(xcb_intern_atom, false, atomNames[i].length, atomNames[i].name);
+
+    for (u32 i = 0; i < std::size(atomNames); ++i)
     {
-        chordKey = e->detail;
-        return;
+        xcb_intern_atom_reply_t* reply = xcb_wait(xcb_intern_atom, cookies[i]);
+        if (!reply)
+            debug_fmts(atomNames[i].name);
+        assert(reply && "could not intern atom");
+        *atomNames[i].atom = reply->atom;
+        free(reply);
     }
-    if (e->detail == chordKey)
+
+    debug_fmt("interned %d atoms in %.3fms", (int)std::size(atomNames), ns_to_ms(now_ns() - start));
+}
+
+// fetched with the scan batch: the session keys, and the name for the log
+static const u8 scanProperties[] = {
+    ClientPropertyWmClass,
+    ClientPropertyNetWmPid,
+    ClientPropertyNetWmName,
+    ClientPropertyWmName,
+};
+
+typedef struct
+{
+    xcb_get_window_attributes_cookie_t attributes;
+    xcb_get_property_cookie_t properties[std::size(scanProperties)];
+} ScanCookies;
+
+// Adopts the windows that already exist on the root. All requests go out before the first reply is read so the whole
+// scan costs two round trips (query tree + one batch) regardless of the window count. Viewable windows keep their
+// mapping; the first ones fill the columns, the rest are parked off screen.
+void scan_windows()
+{
+    u64 start = now_ns();
+
+    xcb_reply_var(tree, xcb_query_tree, screen->root);
+    if (!tree)
         return;
 
-    if (chordKey == dKeycode)
+    u64 treeDone = now_ns();
+
+    int count = xcb_query_tree_children_length(tree);
+    xcb_window_t* children = xcb_query_tree_children(tree);
+    ScanCookies* cookies = (ScanCookies*)malloc(sizeof(ScanCookies) * count);
+
+    for (int i = 0; i < count; ++i)
     {
-        if (e->detail == xKeycode)
-        {
-            xor_swap(activeClients[0], activeClients[1]);
-            arrange();
-            return;
-        }
+        cookies[i].attributes = xcb_send(xcb_get_window_attributes, children[i]);
+        for (u32 j = 0; j < std::size(scanProperties); ++j)
+            cookies[i].properties[j] = request_window_property(children[i], scanProperties[j]);
+    }
+    xcb_flush(conn);
 
-        if (e->detail == fKeycode)
-        {
-            for (uint i = 0; i < std::size(clients); ++i)
-            {
-                Client* client = clients + i;
-                if (client->win)
-                {
-                    if (!is_client_active(i))
-                    {
-                        activeClients[activeCol] = i;
-                        arrange();
-                    }
-
-                    break;
-                }
-            }
+    u64 requestsDone = now_ns();
 
-            return;
-        }
+    u8 adopted = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        xcb_window_t win = children[i];
+        xcb_get_window_attributes_reply_t* attributes = xcb_wait(xcb_get_window_attributes, cookies[i].attributes);
 
-        if (e->detail == tKeycode)
+        if (!attributes || attributes->override_redirect)
         {
-            spawn(termCommand);
-            return;
+            for (auto cookie : cookies[i].properties)
+                xcb_discard_reply(conn, cookie.sequence);
+            free(attributes);
+            continue;
         }
 
-        return;
-    }
+        bool viewable = attributes->map_state == XCB_MAP_STATE_VIEWABLE;
+        free(attributes);
 
-    if (chordKey == sKeycode)
-    {
-        if (e->detail == fKeycode)
+        ClientHandle handle = add_client(win);
+        watch_client(win);
+        for (u32 j = 0; j < std::size(scanProperties); ++j)
+            store_client_property(handle, scanProperties[j], 0, xcb_wait(xcb_get_property, cookies[i].properties[j]));
+        if (viewable)
         {
-            activeCol = !activeCol;
-            if (activeClients[activeCol])
-                focus_window(clients[activeClients[activeCol]].win);
+            get_client(handle)->flags |= ClientFlagMapped;
 
-            return;
+            if (adopted < std::size(activeClients))
+                activeClients[adopted++] = handle;
+            else
+                park_window(win);
         }
 
-        if (e->detail == rKeycode)
-            restart();
+        const char* name;
+        u32 length;
+        if (!get_client_name(handle, &name, &length) || !length)
+        {
+            name = "(no name)";
+            length = strlen(name);
+        }
+        debug_fmt("scan found: %d %.*s%s", win, (int)strnlen(name, length), name, viewable ? " [viewable]" : "");
+    }
 
-        if (e->detail == qKeycode)
-            exit(EXIT_SUCCESS);
+    free(cookies);
+    free(tree);
 
-        return;
-    }
-}
+    if (adopted)
+        arrange();
 
-HANDLER(key_release)
-{
-    if (e->detail == chordKey)
-        chordKey = 0;
+    u64 repliesDone = now_ns();
+    debug_fmt("scan: %d windows, query_tree %.3fms, send %.3fms, replies %.3fms",
+              count,
+              ns_to_ms(treeDone - start),
+              ns_to_ms(requestsDone - treeDone),
+              ns_to_ms(repliesDone - requestsDone));
 }
 
-HANDLER(create_notify)
+void dispatch_event(xcb_generic_event_t* e)
 {
-    if (e->override_redirect || e->parent != screen->root)
-        return;
+    // outside the timed part, the counter reads are syscalls
+    CounterGroupRead counterSample;
+    bool counting = counters_begin(&counterSample);
+
+    FlightEntry* flight = flight_begin(e);
+    u64 sent = wireStats.sent;
+    u64 bytes = wireStats.bytes;
+    u8 type = e->response_type & 0x7F;
+    u64 roundTripSaved = round_trip_enter(type < RoundTripExtensionEvents ? type : RoundTripExtensionEvents);
 
-    for (auto& client : clients)
+    switch (e->response_type & ~0x80)
     {
-        if (!client.win)
+#define X(_event, _type, _window)                                                                                      \
+    case _event:                                                                                                       \
+    {                                                                                                                  \
+        trace_span(#_type);                                                                                            \
+        xcb_##_type##_event_t* ev = (xcb_##_type##_event_t*)(void*)e;                                                  \
+        flight->window = _window;                                                                                      \
+        nyla_handle_##_type(ev);                                                                                       \
+        break;                                                                                                         \
+    }
+        EVENTS(X)
+#undef X
+        case 0:
+        {
+            trace_span("report_error");
+            flight->window = ((xcb_generic_error_t*)e)->resource_id;
+            report_error((xcb_generic_error_t*)e);
+            break;
+        }
+
+        default:
         {
-            client.win = e->window;
-            zero_after(&client, win);
+            if (xkbAvailable && (e->response_type & ~0x80) == xkbEventBase)
+            {
+                trace_span("xkb");
+                dispatch_xkb_event(e);
+            }
             break;
         }
     }
+
+    round_trip_leave(roundTripSaved);
+    flight_end(flight, wireStats.sent - sent);
+    metrics_record_handler(e->response_type, flight->cycles, wireStats.sent - sent, wireStats.bytes - bytes);
+    if (counting)
+        counters_end(&counterSample, e->response_type);
 }
 
-HANDLER(destroy_notify)
+// control socket commands: name, help line
+#define IPC_COMMANDS(X)                                                                                                \
+    X(help, "list commands")                                                                                           \
+    X(metrics, "handler cost and X traffic per event type, loop counters, 'metrics reset' clears them")               \
+    X(counters, "'counters on|off' per-handler perf counters, shown with metrics")                                   \
+    X(trace, "'trace start [seconds]' captures spans until 'trace stop', written as Chrome trace JSON")             \
+    X(prefetch, "'prefetch on|off' placement properties requested at CreateNotify, compare in metrics")          \
+    X(stalls, "event loop iterations that ran past the watchdog threshold, 'stalls reset' clears them")           \
+    X(roundtrips, "synchronous round trips made on the hot path per call site (debug builds)")
+
+void ipc_command_help(IpcReply* reply, char* args);
+
+void ipc_command_metrics(IpcReply* reply, char* args)
 {
-    debug_fmt("removing %dl", e->window);
+    if (!strcmp(args, "reset"))
+    {
+        metrics_reset();
+        counters_reset();
+        zero(&placementStats);
+        zero(&terminalPoolStats);
+        ipc_printf(reply, "metrics reset\n");
+        return;
+    }
+
+    metrics_report(reply, xkbAvailable ? "XKB" : "extension");
+    ipc_printf(reply,
+               "\nloop: %llu batches, %llu events, %llu merged\n",
+               (unsigned long long)loopStats.batches,
+               (unsigned long long)loopStats.events,
+               (unsigned long long)loopStats.merged);
+    ipc_printf(reply,
+               "arrange: %llu requests sent, %llu suppressed\n",
+               (unsigned long long)arrangeStats.sent,
+               (unsigned long long)arrangeStats.suppressed);
+    ipc_printf(reply, "\nplacement (prefetch %s)\n", prefetchOnCreate ? "on" : "off");
+    for (u8 prefetched = 0; prefetched < 2; ++prefetched)
+    {
+        u64 count = placementStats.count[prefetched];
+        if (!count)
+            continue;
+
+        ipc_printf(reply,
+                   "%-16s %6llu  map->decision mean %.3fms max %.3fms  create->decision mean %.3fms max %.3fms\n",
+                   prefetched ? "prefetched" : "fetched at map",
+                   (unsigned long long)count,
+                   ns_to_ms(placementStats.totalNs[prefetched] / count),
+                   ns_to_ms(placementStats.maxNs[prefetched]),
+                   ns_to_ms(placementStats.totalCreateNs[prefetched] / count),
+                   ns_to_ms(placementStats.maxCreateNs[prefetched]));
+    }
 
-    for (auto& client : clients)
+    u64 presses = terminalPoolStats.hits + terminalPoolStats.misses;
+    if (presses)
     {
-        if (client.win == e->window)
+        ipc_printf(reply,
+                   "\nterminal pool: %llu/%llu hits (%.1f%%), %u ready, %u starting\n",
+                   (unsigned long long)terminalPoolStats.hits,
+                   (unsigned long long)presses,
+                   100.0 * terminalPoolStats.hits / presses,
+                   terminalPool.readyCount,
+                   terminalPool.pendingCount);
+        for (u8 fromPool = 0; fromPool < 2; ++fromPool)
         {
-            zero(&client);
-            break;
+            u64 count = terminalPoolStats.visibleCount[fromPool];
+            if (count)
+                ipc_printf(reply,
+                           "%-16s %6llu  press->visible mean %.3fms\n",
+                           fromPool ? "from pool" : "cold launch",
+                           (unsigned long long)count,
+                           ns_to_ms(terminalPoolStats.visibleNs[fromPool] / count));
         }
     }
+    counters_report(reply, xkbAvailable ? "XKB" : "extension");
+}
+
+void ipc_command_prefetch(IpcReply* reply, char* args)
+{
+    if (!strcmp(args, "on"))
+        prefetchOnCreate = true;
+    else if (!strcmp(args, "off"))
+        prefetchOnCreate = false;
+    ipc_printf(reply, "prefetch %s\n", prefetchOnCreate ? "on" : "off");
 }
 
-int get_client_index(xcb_window_t win)
+void ipc_command_counters(IpcReply* reply, char* args)
 {
-    int i = 0;
-    for (auto& client : clients)
+    if (!strcmp(args, "on"))
+    {
+        counters_reset();
+        ipc_printf(reply, counters_enable() ? "counters on\n" : "perf_event_open is not available\n");
+    }
+    else if (!strcmp(args, "off"))
+    {
+        counters_disable();
+        ipc_printf(reply, "counters off\n");
+    }
+    else
     {
-        if (client.win == win)
-            return i;
-        i++;
+        ipc_printf(reply, "counters %s\n", counters.leader >= 0 ? "on" : "off");
     }
-    return -1;
 }
 
-HANDLER(configure_request)
+void ipc_command_trace(IpcReply* reply, char* args)
 {
-    if (is_client_active(get_client_index(e->window)))
+    if (!strncmp(args, "start", 5))
     {
-        arrange();
+        u32 seconds = atoi(args + 5);
+        if (trace_start(seconds))
+            ipc_printf(reply, "tracing%s\n", seconds ? " (stops by itself)" : ", 'trace stop' to write it");
+        else
+            ipc_printf(reply, "already tracing\n");
+    }
+    else if (!strcmp(args, "stop"))
+    {
+        if (trace_stop())
+            ipc_printf(reply, "trace written to %s\n", tracer.path);
+        else
+            ipc_printf(reply, "not tracing\n");
     }
     else
     {
-        xcb_configure_window(conn,
-                             e->window,
-                             (XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH |
-                              XCB_CONFIG_WINDOW_HEIGHT | XCB_CONFIG_WINDOW_STACK_MODE),
-                             (u32[]){screen->width_in_pixels, 0, 20, 20, XCB_STACK_MODE_BELOW});
+        ipc_printf(reply, "%s, %u spans recorded\n", traceEnabled ? "tracing" : "not tracing", tracer.count);
     }
 }
 
-HANDLER(configure_notify) {}
+void ipc_command_stalls(IpcReply* reply, char* args)
+{
+    if (!watchdog.thresholdNs)
+    {
+        ipc_printf(reply, "watchdog off, NYLA_STALL_MS=0\n");
+        return;
+    }
 
-HANDLER(client_message) {}
+    StallStats* stalls = &watchdog.stalls;
+    if (!strcmp(args, "reset"))
+    {
+        zero(stalls);
+        ipc_printf(reply, "stalls reset\n");
+        return;
+    }
 
-HANDLER(mapping_notify)
-{
-    // TODO: only if keyboard mapping
-    map_keyboard();
+    double thresholdMs = ns_to_ms(watchdog.thresholdNs);
+    ipc_printf(reply,
+               "threshold %.0fms: %llu stalls, %llu stacks captured, %.3fms total, %.3fms max\n",
+               thresholdMs,
+               (unsigned long long)stalls->count,
+               (unsigned long long)watchdog.captures,
+               ns_to_ms(stalls->totalNs),
+               ns_to_ms(stalls->maxNs));
+
+    for (u32 i = 0; i < std::size(stalls->buckets); ++i)
+    {
+        if (i + 1 < std::size(stalls->buckets))
+            ipc_printf(reply, "  %6.0f - %6.0fms", thresholdMs * (1 << i), thresholdMs * (2 << i));
+        else
+            ipc_printf(reply, "  %6.0fms or more", thresholdMs * (1 << i));
+        ipc_printf(reply, " %llu\n", (unsigned long long)stalls->buckets[i]);
+    }
 }
 
-HANDLER(focus_in)
+void ipc_command_roundtrips(IpcReply* reply, char* args)
 {
-#if 0
-    if (activeClient)
-        nyla_focus_window(conn, activeClient->window);
+#ifdef NDEBUG
+    ipc_printf(reply, "round trip accounting is compiled out with NDEBUG\n");
+#else
+    u64 total = 0;
+    for (u32 path = 0; path < RoundTripPaths; ++path)
+    {
+        total += roundTrips.paths[path];
+        if (roundTrips.paths[path])
+            ipc_printf(reply,
+                       "%-18s %llu, budget %u, %llu over budget\n",
+                       round_trip_path_name(path),
+                       (unsigned long long)roundTrips.paths[path],
+                       roundTripBudgets.paths[path],
+                       (unsigned long long)roundTrips.overruns[path]);
+    }
+    if (!total)
+        ipc_printf(reply, "no synchronous round trips on the hot path\n");
+
+    for (u32 i = 0; i < roundTrips.siteCount; ++i)
+    {
+        const RoundTripSite* site = roundTrips.sites + i;
+        ipc_printf(reply,
+                   "%s:%d %s %llu, last in %s\n",
+                   site->file,
+                   site->line,
+                   site->what,
+                   (unsigned long long)site->count,
+                   round_trip_path_name(site->path));
+    }
 #endif
 }
 
-HANDLER(focus_out)
+static const struct
 {
-    xcb_configure_window(conn, e->event, XCB_CONFIG_WINDOW_BORDER_WIDTH, (u32[]){0});
+    const char* name;
+    const char* help;
+    void (*run)(IpcReply* reply, char* args);
+} ipcCommands[] = {
+#define X(name, help) {#name, help, ipc_command_##name},
+    IPC_COMMANDS(X)
+#undef X
+};
 
-#if 0
-    if (activeClient)
-        nyla_focus_window(conn, activeClient->window);
-#endif
+void ipc_command_help(IpcReply* reply, char* args)
+{
+    for (auto& command : ipcCommands)
+        ipc_printf(reply, "%-10s %s\n", command.name, command.help);
 }
 
-int main(int argc, const char* _argv[])
+void handle_ipc_command(IpcReply* reply, char* command)
 {
-    argv = _argv;
-    memset(activeClients, ActiveClientUnset, std::size(activeClients));
+    char* args = command + strcspn(command, " ");
+    if (*args)
+        *args++ = '\0';
 
-    logFd = open("/home/izashchelkin/nylalog", O_APPEND | O_TRUNC | O_WRONLY | O_CREAT);
-    if (!logFd)
+    for (auto& it : ipcCommands)
     {
-        logFd = stderr->_fileno;
-        assert(false);
+        if (!strcmp(it.name, command))
+        {
+            it.run(reply, args);
+            return;
+        }
     }
 
+    ipc_printf(reply, "unknown command '%s', try help\n", command);
+}
+
+int main(int argc, const char* _argv[])
+{
+    argv = _argv;
+
+    log_init();
+
     {
         dpy = XOpenDisplay(NULL);
         assert(dpy && "could not connect to X server");
@@ -422,84 +1659,52 @@ int main(int argc, const char* _argv[])
                                        XCB_EVENT_MASK_FOCUS_CHANGE});
         assert(ok && "could not change root window attributes");
 
-#define X(name)                                                                                                        \
-    do                                                                                                                 \
-    {                                                                                                                  \
-        xcb_reply_var(r, xcb_intern_atom, false, std::size(#name) - 1, #name);                                         \
-        assert(r && "could not intern " #name);                                                                        \
-        ATOM_##name = r->atom;                                                                                         \
-        free(r);                                                                                                       \
-    }                                                                                                                  \
-    while (0);
-        ATOMS(X)
-#undef X
+        intern_atoms();
     }
 
-    map_keyboard();
-
+    init_xkb();
+    flight_init(xkbAvailable ? xkbEventBase : 0);
+    metrics_init();
+    if (const char* enable = getenv("NYLA_COUNTERS"); enable && *enable == '1')
+        counters_enable();
+    if (const char* prefetch = getenv("NYLA_PREFETCH"); prefetch && *prefetch == '0')
+        prefetchOnCreate = false;
+    if (const char* pool = getenv("NYLA_TERMINAL_POOL"); pool && *pool)
     {
-        xcb_reply_var(reply, xcb_query_tree, screen->root);
-
-        Client* client = clients;
-        xcb_window_t* it = xcb_query_tree_children(reply);
-
-        for (int i = 0; i < xcb_query_tree_children_length(reply); ++i, ++it)
-        {
-            xcb_window_t win = *it;
-
-            debug_fmt("scan found: %d", win);
-
-            xcb_reply_var(reply, xcb_get_window_attributes, win);
-            if (!reply)
-                continue;
-            if (reply->override_redirect)
-            {
-                free(reply);
-                continue;
-            }
-            free(reply);
-
-            (client++)->win = win;
+        unsigned long size = strtoul(pool, NULL, 10);
+        terminalPoolSize = size < std::size(terminalPool.ready) ? (u8)size : (u8)std::size(terminalPool.ready);
+    }
+    map_keyboard();
 
-            char* name = get_window_name(win);
-            if (name)
-            {
-                debug_fmts(name);
-                free(name);
-            }
-            else
-            {
-                debug_fmts("name is null!");
-            }
+    bool restored = restore_state();
+    if (!restored)
+        scan_windows();
+    bool recover = session_open() && !restored;
+    restore_session(recover);
 
-            xcb_unmap_window(conn, *it);
-        }
+    // CLOCK_MONOTONIC is system wide, so the timestamp of the previous image is comparable
+    if (const char* restartNs = getenv("NYLA_RESTART_NS"))
+    {
+        debug_fmt("restart took %.3fms (%s)",
+                  ns_to_ms(now_ns() - strtoull(restartNs, NULL, 10)),
+                  restored ? "state handoff" : "rescan");
+        unsetenv("NYLA_RESTART_NS");
     }
 
     initOverlay();
 
-    while (true)
-    {
-        xcb_flush(conn);
-        xcb_generic_event_t* e = xcb_wait_for_event(conn);
-        do
-        {
-            switch (e->response_type & ~0x80)
-            {
-#define X(_event, _type)                                                                                               \
-    case _event: nyla_handle_##_type((xcb_##_type##_event_t*)(void*)e); break;
-                EVENTS(X)
-#undef X
-                case 0:
-                {
-                    xcb_generic_error_t* error = (xcb_generic_error_t*)e;
-                    debug_fmt("ERROR! %d", error->error_code);
-                    break;
-                }
-            }
-
-            e = xcb_poll_for_event(conn);
-        }
-        while (e);
-    }
+    loop_init();
+    chordTimer = loop_add_timer(0, 0, chord_timeout, NULL);
+    loop_add_signal(SIGCHLD, reap_children, NULL);
+    loop_add_signal(SIGUSR1, flight_signal, NULL);
+    ipc_init(handle_ipc_command);
+    trace_init();
+    loop_add_signal(SIGUSR2, trace_toggle, NULL);
+    watchdog_init();
+    if (recover)
+        sessionOrphanTimer = loop_add_timer(sessionRestoreWindowNs, 0, expire_session_orphans, NULL);
+    terminalPool.refillTimer = loop_add_timer(0, 0, refill_terminal_pool, NULL);
+    if (terminalPoolSize)
+        refill_terminal_pool(NULL, 0);
+    loop_run(dispatch_event);
 }
@@ -1,17 +1,24 @@
 #pragma once
 
+#include <atomic>
 #include <iterator>
+#include <type_traits>
 
 #include <fcntl.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/stat.h>
+#include <sys/wait.h>
+
 #include <X11/X.h>
 #include <X11/Xlib-xcb.h>
 #include <X11/Xlib.h>
@@ -19,7 +26,6 @@
 
 #include <xcb/xcb.h>
 #include <xcb/xcb_aux.h>
-#include <xcb/xcb_keysyms.h>
 #include <xcb/xproto.h>
 
 #include <EGL/egl.h>
@@ -36,7 +42,66 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
-#define debug_fmt(fmt, ...) dprintf(logFd, "[%s:%d] " fmt "\n", __FILE__, __LINE__, __VA_ARGS__);
+static inline u64 now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+#define ns_to_ms(ns) ((double)(ns) / 1e6)
+
+// cycle counter for the hot paths, converted to time only when somebody reads the numbers
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline u64 read_tsc()
+{
+    return __rdtsc();
+}
+#else
+static inline u64 read_tsc()
+{
+    return now_ns();
+}
+#endif
+
+#include "log.hpp"
+
+template <typename T> static inline u64 log_arg(T value)
+{
+    if constexpr (std::is_floating_point_v<T>)
+    {
+        double d = value;
+        u64 bits;
+        memcpy(&bits, &d, sizeof(bits));
+        return bits;
+    }
+    else if constexpr (std::is_pointer_v<T>)
+        return (u64)(uintptr_t)value;
+    else if constexpr (std::is_signed_v<T>)
+        return (u64)(i64)value;
+    else
+        return (u64)value;
+}
+
+void log_record(const LogSite* site, const u64* values, u32 count);
+void log_flush();
+
+template <u32 expected, typename... Args> static inline void log_write(const LogSite* site, Args... args)
+{
+    static_assert(sizeof...(Args) == expected, "debug_fmt arguments do not match the format");
+    const u64 values[sizeof...(Args) + 1] = {log_arg(args)...};
+    log_record(site, values, sizeof...(Args));
+}
+
+// Only the site and the raw arguments are queued, see log.cpp
+#define debug_fmt(fmt, ...)                                                                                            \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        static constexpr LogSite logSite = log_site(fmt, __FILE__, __LINE__);                                          \
+        log_write<logSite.argCount>(&logSite, __VA_ARGS__);                                                            \
+    }                                                                                                                  \
+    while (0)
 #define debug_fmtd(i) debug_fmt("%d", i)
 #define debug_fmts(s) debug_fmt("%s", s)
 
@@ -44,6 +109,7 @@ typedef uint64_t u64;
     if (!(that))                                                                                                       \
     {                                                                                                                  \
         debug_fmts(#that);                                                                                             \
+        log_flush();                                                                                                   \
         *((volatile int*)0) = 0;                                                                                       \
         __builtin_unreachable();                                                                                       \
     }
@@ -63,18 +129,148 @@ typedef uint64_t u64;
            0,                                                                                                          \
            sizeof(*(ptr)) - offsetof(__typeof__(*(ptr)), member) - sizeof((ptr)->member));
 
-#define xcb_checked(name, ...) xcb_request_check(conn, name##_checked(conn, __VA_ARGS__))
-#define xcb_reply(name, ...) name##_reply(conn, name(conn, __VA_ARGS__), NULL)
+// Span tracing, see trace.cpp. While tracing is off a span costs one predictable branch at each end.
+extern bool traceEnabled;
+void trace_record(const char* name, u64 startTsc, u64 endTsc);
+
+struct TraceSpan
+{
+    const char* name;
+    u64 start;
+
+    TraceSpan(const char* name) : name(name), start(__builtin_expect(traceEnabled, 0) ? read_tsc() : 0) {}
+    ~TraceSpan()
+    {
+        if (__builtin_expect(start != 0, 0))
+            trace_record(name, start, read_tsc());
+    }
+};
+
+#define trace_concat_(a, b) a##b
+#define trace_concat(a, b) trace_concat_(a, b)
+// name has to be a string literal, it is kept by pointer until the trace is written
+#define trace_span(name) TraceSpan trace_concat(traceSpan, __LINE__)(name)
+
+// Every call that blocks on the server goes through round_trip(), which debug builds count on the hot path, see
+// roundtrips.cpp.
+#ifdef NDEBUG
+#define round_trip(what) ((void)0)
+#else
+void note_round_trip(const char* what, const char* file, int line);
+#define round_trip(what) note_round_trip(what, __FILE__, __LINE__)
+#endif
+
+#define xcb_checked(name, ...)                                                                                         \
+    (round_trip(#name), xcb_request_check(conn, xcb_send_as(name, name##_checked, __VA_ARGS__)))
+// sends an unchecked request and remembers its call site so report_error() can attribute async errors
+#define xcb_tracked(name, ...) track_request(xcb_send(name, __VA_ARGS__).sequence, #name, __FILE__, __LINE__)
+#define xcb_reply(name, ...) (round_trip(#name), name##_reply(conn, xcb_send(name, __VA_ARGS__), NULL))
 #define xcb_reply_var(var, name, ...) name##_reply_t* var = xcb_reply(name, __VA_ARGS__)
+// blocks on the reply to a request that is already out; xcb_await is the non-blocking variant
+#define xcb_wait(name, cookie) (round_trip(#name), name##_reply(conn, cookie, NULL))
 
 // clang-format off
 #define KEYS(X) \
-    X(q, 0) X(w, 0) X(e, 0) X(r, 0) X(t, 0) \
-    X(a, 0) X(s, 1) X(d, 1) X(f, 0) X(g, 0) \
-    X(z, 0) X(x, 0) X(c, 0) X(v, 0) X(b, 0)
+    X(q) X(w) X(e) X(r) X(t) \
+    X(a) X(s) X(d) X(f) X(g) \
+    X(z) X(x) X(c) X(v) X(b)
 // clang-format on
 
-extern int logFd;
+#define ATOMS(X)                                                                                                       \
+    X(UTF8_STRING)                                                                                                     \
+    X(WM_NAME)                                                                                                         \
+    X(_NET_WM_NAME)                                                                                                    \
+    X(_NET_WM_PID)                                                                                                     \
+    X(_NET_WM_WINDOW_TYPE)                                                                                             \
+    X(_NET_WM_WINDOW_TYPE_DIALOG)                                                                                      \
+    X(_NET_WM_WINDOW_TYPE_UTILITY)                                                                                     \
+    X(_NET_WM_WINDOW_TYPE_TOOLBAR)                                                                                     \
+    X(_NET_WM_WINDOW_TYPE_SPLASH)                                                                                      \
+    X(_NET_WM_WINDOW_TYPE_MENU)                                                                                        \
+    X(_NET_WM_WINDOW_TYPE_DROPDOWN_MENU)                                                                               \
+    X(_NET_WM_WINDOW_TYPE_POPUP_MENU)                                                                                  \
+    X(_NET_WM_WINDOW_TYPE_TOOLTIP)                                                                                     \
+    X(_NET_WM_WINDOW_TYPE_NOTIFICATION)
+
+#define X(atom) extern xcb_atom_t ATOM_##atom;
+ATOMS(X)
+#undef X
+
+// name, atom, max length in 32-bit units
+#define CLIENT_PROPERTIES(X)                                                                                           \
+    X(WmName, XCB_ATOM_WM_NAME, 64)                                                                                    \
+    X(NetWmName, ATOM__NET_WM_NAME, 64)                                                                                \
+    X(WmClass, XCB_ATOM_WM_CLASS, 64)                                                                                  \
+    X(WmNormalHints, XCB_ATOM_WM_NORMAL_HINTS, 18)                                                                     \
+    X(WmHints, XCB_ATOM_WM_HINTS, 9)                                                                                   \
+    X(NetWmPid, ATOM__NET_WM_PID, 1)                                                                                   \
+    X(WmTransientFor, XCB_ATOM_WM_TRANSIENT_FOR, 1)                                                                    \
+    X(NetWmWindowType, ATOM__NET_WM_WINDOW_TYPE, 8)
+
+enum
+{
+#define X(name, atom, length) ClientProperty##name,
+    CLIENT_PROPERTIES(X)
+#undef X
+    ClientPropertyCount
+};
+
+enum
+{
+    PropertyUnloaded,
+    PropertyPending,
+    PropertyValid,
+};
+
+typedef struct
+{
+    u32 offset; // into the property arena
+    u16 length;
+    u8 state;
+    u8 serial; // bumped on invalidation so late replies for an older value are dropped
+} CachedProperty;
+
+enum
+{
+    ClientFlagMapped = 1 << 0,
+    ClientFlagMapSent = 1 << 1,      // map requested, MapNotify not seen yet
+    ClientFlagGeometryValid = 1 << 2, // x/y/width/height hold what was last sent
+    ClientFlagStackValid = 1 << 3,    // stackMode still describes the real stacking
+    ClientFlagConfigured = 1 << 4,    // geometry was sent since the flag was last cleared
+    ClientFlagFloating = 1 << 5,      // keeps its own geometry, never tiled or parked
+    ClientFlagPooled = 1 << 6,        // warm terminal kept unmapped until it is handed out
+    ClientFlagFromPool = 1 << 7,      // handed out from the pool, for the press->visible stats
+};
+
+typedef struct
+{
+    xcb_window_t win;
+    u32 flags;
+
+    // last state sent to the server, arrange() only emits what differs
+    i16 x;
+    i16 y;
+    u16 width;
+    u16 height;
+    u8 borderWidth;
+    u8 stackMode;
+
+    CachedProperty properties[ClientPropertyCount];
+    u64 createdAt;
+    u64 requestedAt; // key press that asked for this window, 0 once it is visible
+} Client;
+
+// generation in the high half, slot in the low half; see clients.cpp
+typedef u64 ClientHandle;
+#define ClientHandleNull ((ClientHandle)0)
+
+typedef void (*LoopCallback)(void* data, u64 arg);
+
+int loop_add_timer(u64 initialNs, u64 intervalNs, LoopCallback callback, void* data);
+void loop_arm_timer(int fd, u64 initialNs, u64 intervalNs);
+
+u32 track_request(u32 sequence, const char* what, const char* file, int line);
+
 extern Display* dpy;
 extern xcb_connection_t* conn;
 extern xcb_window_t overlayWindow;
@@ -0,0 +1,90 @@
+// Client lookup microbenchmark: find_client, find_client_handle + get_client and a miss for 10 to 10,000 clients,
+// next to the linear scan over the dense array that the window table replaced. Window ids are laid out the way the
+// server hands them out, a few per X client spaced by the resource id mask, and looked up in random order.
+//
+//   nylabench-clients [lookups]    defaults to 1,000,000 per measurement
+
+#include "nyla.hpp"
+
+#include "log.cpp"
+#include "clients.cpp"
+
+static u32 bench_random(u64* state)
+{
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (u32)((*state * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+static Client* find_client_linear(xcb_window_t win)
+{
+    for (u32 i = 0; i < clientCount; ++i)
+        if (clients[i].win == win)
+            return clients + i;
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    u32 lookups = argc > 1 ? (u32)strtoul(argv[1], NULL, 10) : 1000000;
+    if (!lookups)
+        lookups = 1;
+
+    static const u32 sizes[] = {10, 100, 1000, 10000};
+    xcb_window_t* windows = (xcb_window_t*)malloc(sizeof(xcb_window_t) * sizes[std::size(sizes) - 1]);
+    u32* order = (u32*)malloc(sizeof(u32) * lookups);
+    u64 rng = 0x9E3779B97F4A7C15ull;
+    uintptr_t sink = 0;
+
+    printf("%8s %14s %14s %14s %14s\n", "clients", "find_client", "handle+get", "miss", "linear scan");
+    for (u32 size : sizes)
+    {
+        for (u32 i = 0; i < size; ++i)
+        {
+            // 8 windows per X client, X clients 0x200000 apart
+            windows[i] = 0x400000 + (i / 8) * 0x200000 + (i % 8) * 3 + 1;
+            add_client(windows[i]);
+        }
+        for (u32 i = 0; i < lookups; ++i)
+            order[i] = bench_random(&rng) % size;
+
+        double ns[4];
+        for (u32 kind = 0; kind < std::size(ns); ++kind)
+        {
+            // the linear scan gets fewer lookups at the large sizes, it is there for scale
+            u32 count = kind == 3 ? lookups / (size / 10 ? size / 10 : 1) + 1 : lookups;
+            u64 start = now_ns();
+            for (u32 i = 0; i < count; ++i)
+            {
+                xcb_window_t win = windows[order[i]];
+                switch (kind)
+                {
+                    case 0:
+                        sink += (uintptr_t)find_client(win);
+                        break;
+                    case 1:
+                        sink += (uintptr_t)get_client(find_client_handle(win));
+                        break;
+                    case 2:
+                        sink += (uintptr_t)find_client(win + 0x100000);
+                        break;
+                    case 3:
+                        sink += (uintptr_t)find_client_linear(win);
+                        break;
+                }
+            }
+            ns[kind] = (double)(now_ns() - start) / count;
+        }
+
+        printf("%8u %12.2fns %12.2fns %12.2fns %12.2fns\n", size, ns[0], ns[1], ns[2], ns[3]);
+
+        for (u32 i = 0; i < size; ++i)
+            remove_client(windows[i]);
+    }
+
+    free(order);
+    free(windows);
+    return sink == 1;
+}
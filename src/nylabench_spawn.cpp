@@ -0,0 +1,161 @@
+// Key press to exec benchmark for spawn(): fork + execvp, the way nyla used to launch commands, against posix_spawnp.
+// The process first touches a heap of the given size so fork has page tables to copy, like nyla does with the EGL
+// driver mapped. Each launch re-executes this binary, which writes CLOCK_MONOTONIC to a pipe as soon as it runs, so
+// press->exec is the time until the new program is running and blocked is how long the caller could not handle events.
+//
+//   nylabench-spawn [heap MB] [launches]    defaults to 512 MB and 50 launches
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+
+static u64 now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+static pid_t launch_fork(char* const* command)
+{
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    int devNull = open("/dev/null", O_RDONLY);
+    dup2(devNull, STDIN_FILENO);
+    close(devNull);
+
+    devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+    close(devNull);
+
+    setsid();
+    execvp(command[0], command);
+    _exit(EXIT_FAILURE);
+}
+
+static pid_t launch_posix_spawn(char* const* command)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+
+    pid_t pid;
+    int err = posix_spawnp(&pid, command[0], &actions, &attr, command, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return err ? -1 : pid;
+}
+
+int main(int argc, char** argv)
+{
+    // a launched copy reports when it started running
+    if (argc == 3 && !strcmp(argv[1], "--stamp"))
+    {
+        u64 stamp = now_ns();
+        return write(atoi(argv[2]), &stamp, sizeof(stamp)) != sizeof(stamp);
+    }
+
+    u64 heapMb = argc > 1 ? strtoull(argv[1], NULL, 10) : 512;
+    u32 launches = argc > 2 ? (u32)strtoul(argv[2], NULL, 10) : 50;
+    if (!launches)
+        launches = 1;
+
+    char* heap = (char*)malloc(heapMb << 20);
+    if (heapMb && !heap)
+    {
+        fprintf(stderr, "could not allocate %llu MB\n", (unsigned long long)heapMb);
+        return 1;
+    }
+    for (u64 i = 0; i < heapMb << 20; i += 4096)
+        heap[i] = 1;
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) || fcntl(fds[1], F_SETFD, 0))
+    {
+        perror("pipe");
+        return 1;
+    }
+
+    char self[4096];
+    ssize_t selfLength = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (selfLength < 0)
+    {
+        perror("/proc/self/exe");
+        return 1;
+    }
+    self[selfLength] = 0;
+
+    char fd[16];
+    snprintf(fd, sizeof(fd), "%d", fds[1]);
+    char stampArg[] = "--stamp";
+    char* command[] = {self, stampArg, fd, NULL};
+
+    static const struct
+    {
+        const char* name;
+        pid_t (*launch)(char* const* command);
+    } methods[] = {
+        {"fork+exec", launch_fork},
+        {"posix_spawn", launch_posix_spawn},
+    };
+
+    printf("%llu MB touched heap, %u launches each\n", (unsigned long long)heapMb, launches);
+    printf("%-12s %24s %24s\n", "", "blocked mean/max", "press->exec mean/max");
+    for (auto& method : methods)
+    {
+        u64 blockedTotal = 0, blockedMax = 0, execTotal = 0, execMax = 0;
+        for (u32 i = 0; i < launches; ++i)
+        {
+            u64 pressedAt = now_ns();
+            pid_t pid = method.launch(command);
+            u64 blocked = now_ns() - pressedAt;
+
+            u64 stamp;
+            if (pid < 0 || read(fds[0], &stamp, sizeof(stamp)) != sizeof(stamp))
+            {
+                fprintf(stderr, "%s: launch failed\n", method.name);
+                return 1;
+            }
+            waitpid(pid, NULL, 0);
+
+            u64 exec = stamp - pressedAt;
+            blockedTotal += blocked;
+            execTotal += exec;
+            if (blocked > blockedMax)
+                blockedMax = blocked;
+            if (exec > execMax)
+                execMax = exec;
+        }
+
+        printf("%-12s %10.3fms %9.3fms %10.3fms %9.3fms\n",
+               method.name,
+               blockedTotal / 1e6 / launches,
+               blockedMax / 1e6,
+               execTotal / 1e6 / launches,
+               execMax / 1e6);
+    }
+
+    free(heap);
+    return 0;
+}
@@ -0,0 +1,59 @@
+// Sends one command to a running nyla over its control socket and prints the answer.
+//
+//   nylactl help
+//   nylactl metrics [reset]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int main(int argc, char** argv)
+{
+    const char* path = getenv("NYLA_SOCKET");
+    char defaultPath[108];
+    if (!path || !*path)
+    {
+        const char* runtimeDir = getenv("XDG_RUNTIME_DIR");
+        snprintf(defaultPath, sizeof(defaultPath), "%s/nyla.sock", runtimeDir ? runtimeDir : "/tmp");
+        path = defaultPath;
+    }
+
+    char command[256] = "";
+    for (int i = 1; i < argc; ++i)
+    {
+        if (i > 1)
+            strncat(command, " ", sizeof(command) - strlen(command) - 1);
+        strncat(command, argv[i], sizeof(command) - strlen(command) - 1);
+    }
+    if (!*command)
+        strcpy(command, "help");
+    strncat(command, "\n", sizeof(command) - strlen(command) - 1);
+
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)))
+    {
+        perror(path);
+        return 1;
+    }
+
+    if (write(fd, command, strlen(command)) != (ssize_t)strlen(command))
+    {
+        perror("write");
+        return 1;
+    }
+
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+        fwrite(buffer, 1, n, stdout);
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,133 @@
+// Renders a nyla flight recorder dump as a timeline, oldest event first: time relative to the dump, gap to the previous
+// event, event type, window, sequence, handler duration with a bar scaled to the slowest handler, and the X requests
+// the handler issued. A handler that was still running when the dump was taken is marked, after a crash that is the one
+// that crashed.
+//
+//   nylaflight [file]    defaults to $XDG_RUNTIME_DIR/nyla-flight
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int8_t i8;
+typedef int16_t i16;
+typedef int32_t i32;
+typedef int64_t i64;
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#include "flight.hpp"
+
+int main(int argc, char** argv)
+{
+    char defaultPath[256];
+    const char* path = argc > 1 ? argv[1] : NULL;
+    if (!path)
+    {
+        const char* runtimeDir = getenv("XDG_RUNTIME_DIR");
+        snprintf(defaultPath, sizeof(defaultPath), "%s/nyla-flight", runtimeDir ? runtimeDir : "/tmp");
+        path = defaultPath;
+    }
+
+    FILE* in = fopen(path, "rb");
+    if (!in)
+    {
+        perror(path);
+        return 1;
+    }
+
+    FlightHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, FlightMagic, sizeof(header.magic)) ||
+        header.capacity != FlightCapacity)
+    {
+        fprintf(stderr, "%s: not a flight recorder dump of this version\n", path);
+        return 1;
+    }
+
+    FlightEntry* entries = (FlightEntry*)malloc(sizeof(FlightEntry) * FlightCapacity);
+    if (fread(entries, sizeof(FlightEntry), FlightCapacity, in) != FlightCapacity)
+    {
+        fprintf(stderr, "%s: truncated dump\n", path);
+        return 1;
+    }
+    fclose(in);
+
+    double ticksPerNs = header.nsDump > header.nsStart
+                            ? (double)(header.tscDump - header.tscStart) / (double)(header.nsDump - header.nsStart)
+                            : 1.0;
+    if (ticksPerNs <= 0)
+        ticksPerNs = 1.0;
+
+    u64 count = header.next < FlightCapacity ? header.next : FlightCapacity;
+    u64 first = header.next - count;
+
+    u32 slowest = 1;
+    for (u64 i = first; i < header.next; ++i)
+    {
+        FlightEntry* entry = entries + (i & (FlightCapacity - 1));
+        if (entry->cycles != FlightRunning && entry->cycles > slowest)
+            slowest = entry->cycles;
+    }
+
+    printf("%llu events, dump reason signal %u, slowest handler %.1fus\n",
+           (unsigned long long)count,
+           header.reason,
+           slowest / ticksPerNs / 1e3);
+    printf("%12s %10s  %-24s %-10s %5s %10s %4s\n", "ms", "gap ms", "event", "window", "seq", "handler", "req");
+
+    u64 previousTsc = 0;
+    for (u64 i = first; i < header.next; ++i)
+    {
+        FlightEntry* entry = entries + (i & (FlightCapacity - 1));
+
+        u8 type = entry->type & 0x7F;
+        char name[32];
+        if (header.xkbEventBase && type == header.xkbEventBase)
+            snprintf(name, sizeof(name), "XKB");
+        else if (type < sizeof(coreEventNames) / sizeof(coreEventNames[0]))
+            snprintf(name, sizeof(name), "%s", coreEventNames[type]);
+        else
+            snprintf(name, sizeof(name), "event %u", type);
+        if (entry->type & 0x80)
+            strncat(name, " (sent)", sizeof(name) - strlen(name) - 1);
+
+        double at = ((double)(i64)(entry->tsc - header.tscDump)) / ticksPerNs / 1e6;
+        double gap = previousTsc ? (double)(entry->tsc - previousTsc) / ticksPerNs / 1e6 : 0.0;
+        previousTsc = entry->tsc;
+
+        if (entry->cycles == FlightRunning)
+        {
+            printf("%12.3f %10.3f  %-24s 0x%08x %5u %10s %4s  <- still running\n",
+                   at,
+                   gap,
+                   name,
+                   entry->window,
+                   entry->sequence,
+                   "-",
+                   "-");
+            continue;
+        }
+
+        char bar[41];
+        u32 barLength = (u32)((u64)entry->cycles * 40 / slowest);
+        memset(bar, '#', barLength);
+        bar[barLength] = '\0';
+
+        printf("%12.3f %10.3f  %-24s 0x%08x %5u %8.1fus %4u  %s\n",
+               at,
+               gap,
+               name,
+               entry->window,
+               entry->sequence,
+               entry->cycles / ticksPerNs / 1e3,
+               entry->requests,
+               bar);
+    }
+
+    free(entries);
+    return 0;
+}
@@ -0,0 +1,155 @@
+// Decodes a binary nyla log (NYLA_LOG_BINARY=1) into the same text the WM writes otherwise, each line prefixed with the
+// time in ms since the first entry.
+//
+//   nylalog [file]    reads stdin without a file
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int8_t i8;
+typedef int16_t i16;
+typedef int32_t i32;
+typedef int64_t i64;
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#include "log.hpp"
+
+typedef struct
+{
+    u64 id;
+    u32 line;
+    u64 kinds;
+    u8 argCount;
+    char* file;
+    char* fmt;
+} DecodedSite;
+
+static DecodedSite* sites;
+static u32 siteCount;
+static u32 siteCapacity;
+
+static bool read_exact(FILE* in, void* data, size_t size)
+{
+    return fread(data, 1, size, in) == size;
+}
+
+template <typename T> static bool read_value(FILE* in, T* value)
+{
+    return read_exact(in, value, sizeof(*value));
+}
+
+static char* read_string(FILE* in, u16 length)
+{
+    char* string = (char*)malloc(length + 1);
+    if (!read_exact(in, string, length))
+    {
+        free(string);
+        return NULL;
+    }
+    string[length] = '\0';
+    return string;
+}
+
+static DecodedSite* find_site(u64 id)
+{
+    // newest first, a repeated definition replaces the older one
+    for (u32 i = siteCount; i-- > 0;)
+        if (sites[i].id == id)
+            return sites + i;
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    FILE* in = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if (!in)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    char magic[sizeof(LogFileMagic) - 1];
+    if (!read_exact(in, magic, sizeof(magic)) || memcmp(magic, LogFileMagic, sizeof(magic)))
+    {
+        fprintf(stderr, "not a binary nyla log\n");
+        return 1;
+    }
+
+    u64 firstTimestamp = 0;
+    u8 type;
+    while (read_value(in, &type))
+    {
+        switch (type)
+        {
+            case LogRecordSite:
+            {
+                DecodedSite site = {};
+                u16 fileLength, fmtLength;
+                if (!read_value(in, &site.id) || !read_value(in, &site.line) || !read_value(in, &site.kinds) ||
+                    !read_value(in, &site.argCount) || !read_value(in, &fileLength) || !read_value(in, &fmtLength) ||
+                    !(site.file = read_string(in, fileLength)) || !(site.fmt = read_string(in, fmtLength)))
+                {
+                    fprintf(stderr, "truncated site definition\n");
+                    return 1;
+                }
+
+                if (siteCount == siteCapacity)
+                {
+                    siteCapacity = siteCapacity ? siteCapacity * 2 : 256;
+                    sites = (DecodedSite*)realloc(sites, sizeof(DecodedSite) * siteCapacity);
+                }
+                sites[siteCount++] = site;
+                break;
+            }
+
+            case LogRecordEntry:
+            {
+                u64 id, timestamp;
+                u16 size;
+                u8 payload[65536];
+                if (!read_value(in, &id) || !read_value(in, &timestamp) || !read_value(in, &size) ||
+                    !read_exact(in, payload, size))
+                {
+                    fprintf(stderr, "truncated entry\n");
+                    return 1;
+                }
+
+                if (!firstTimestamp)
+                    firstTimestamp = timestamp;
+
+                DecodedSite* site = find_site(id);
+                if (!site)
+                {
+                    printf("%12.3f [?] entry for unknown site %#llx\n",
+                           (double)(timestamp - firstTimestamp) / 1e6,
+                           (unsigned long long)id);
+                    break;
+                }
+
+                char text[4096];
+                log_format(site->fmt, site->kinds, site->argCount, payload, size, text, sizeof(text));
+                printf("%12.3f [%s:%u] %s\n", (double)(timestamp - firstTimestamp) / 1e6, site->file, site->line, text);
+                break;
+            }
+
+            case LogRecordDropped:
+            {
+                u64 dropped;
+                if (!read_value(in, &dropped))
+                    return 1;
+                printf("%12s [log] %llu entries dropped\n", "", (unsigned long long)dropped);
+                break;
+            }
+
+            default: fprintf(stderr, "unknown record type %u\n", type); return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,277 @@
+#include "nyla.hpp"
+
+// Per-client cache of the properties listed in CLIENT_PROPERTIES. Values are fetched on first use through the
+// coroutine layer and stay valid until a PropertyNotify for that atom arrives, so repeated reads cost no round trips.
+// Raw values live in one bump-allocated arena addressed by offset; dead values are reclaimed by compacting the arena
+// once they make up more than half of it.
+
+static char* propertyArena;
+static u32 propertyArenaSize;
+static u32 propertyArenaCapacity;
+static u32 propertyArenaWasted;
+
+static xcb_atom_t client_property_atom(u8 id)
+{
+    switch (id)
+    {
+#define X(name, atom, length)                                                                                          \
+    case ClientProperty##name: return atom;
+        CLIENT_PROPERTIES(X)
+#undef X
+    }
+    return XCB_NONE;
+}
+
+static const u32 clientPropertyLengths[] = {
+#define X(name, atom, length) length,
+    CLIENT_PROPERTIES(X)
+#undef X
+};
+
+static void property_arena_compact()
+{
+    char* old = propertyArena;
+    propertyArena = (char*)malloc(propertyArenaCapacity);
+    assert(propertyArena);
+    propertyArenaSize = 0;
+    propertyArenaWasted = 0;
+
+    for (u32 i = 0; i < clientCount; ++i)
+    {
+        for (auto& property : clients[i].properties)
+        {
+            if (property.state != PropertyValid)
+                continue;
+
+            memcpy(propertyArena + propertyArenaSize, old + property.offset, property.length);
+            property.offset = propertyArenaSize;
+            propertyArenaSize += property.length;
+        }
+    }
+
+    free(old);
+}
+
+static void property_release(CachedProperty* property)
+{
+    if (property->state == PropertyValid)
+        propertyArenaWasted += property->length;
+    property->state = PropertyUnloaded;
+    ++property->serial;
+}
+
+static void property_store(CachedProperty* property, const void* value, u32 length)
+{
+    if (propertyArenaWasted > propertyArenaSize / 2 && propertyArenaWasted > 4096)
+        property_arena_compact();
+
+    if (propertyArenaSize + length > propertyArenaCapacity)
+    {
+        while (propertyArenaSize + length > propertyArenaCapacity)
+            propertyArenaCapacity = propertyArenaCapacity ? propertyArenaCapacity * 2 : 16384;
+        propertyArena = (char*)realloc(propertyArena, propertyArenaCapacity);
+        assert(propertyArena);
+    }
+
+    // two loads of the same value can race, the later one wins
+    if (property->state == PropertyValid)
+        propertyArenaWasted += property->length;
+
+    if (length)
+        memcpy(propertyArena + propertyArenaSize, value, length);
+    property->offset = propertyArenaSize;
+    property->length = length;
+    property->state = PropertyValid;
+    propertyArenaSize += length;
+}
+
+// Bare request for a window that is not a client yet, the reply can be stored once it is.
+xcb_get_property_cookie_t request_window_property(xcb_window_t win, u8 id)
+{
+    return xcb_send(
+        xcb_get_property, 0, win, client_property_atom(id), XCB_GET_PROPERTY_TYPE_ANY, 0, clientPropertyLengths[id]);
+}
+
+xcb_get_property_cookie_t request_client_property(Client* client, u8 id)
+{
+    client->properties[id].state = PropertyPending;
+    return request_window_property(client->win, id);
+}
+
+// Tasks that wait for a load somebody else already started, instead of sending a second request for it.
+typedef struct
+{
+    ClientHandle handle;
+    u8 id;
+    std::coroutine_handle<> waiter;
+} PropertyWaiter;
+
+static PropertyWaiter* propertyWaiters;
+static u32 propertyWaiterCount;
+static u32 propertyWaiterCapacity;
+
+struct PropertyAwaiter
+{
+    ClientHandle handle;
+    u8 id;
+
+    bool await_ready()
+    {
+        Client* client = get_client(handle);
+        return !client || client->properties[id].state != PropertyPending;
+    }
+
+    void await_suspend(std::coroutine_handle<> waiter)
+    {
+        if (propertyWaiterCount == propertyWaiterCapacity)
+        {
+            propertyWaiterCapacity = propertyWaiterCapacity ? propertyWaiterCapacity * 2 : 16;
+            propertyWaiters =
+                (PropertyWaiter*)realloc(propertyWaiters, sizeof(PropertyWaiter) * propertyWaiterCapacity);
+            assert(propertyWaiters);
+        }
+        propertyWaiters[propertyWaiterCount++] = {.handle = handle, .id = id, .waiter = waiter};
+    }
+
+    void await_resume() {}
+};
+
+static void resume_property_waiters(ClientHandle handle, u8 id)
+{
+    for (u32 i = 0; i < propertyWaiterCount;)
+    {
+        PropertyWaiter waiting = propertyWaiters[i];
+        if (waiting.handle != handle || waiting.id != id)
+        {
+            ++i;
+            continue;
+        }
+
+        // remove before resuming, the task may wait again and append a new entry
+        propertyWaiters[i] = propertyWaiters[--propertyWaiterCount];
+        waiting.waiter.resume();
+    }
+}
+
+// Stores the reply unless the property was invalidated after the request went out. Frees the reply.
+void store_client_property(ClientHandle handle, u8 id, u8 serial, xcb_get_property_reply_t* reply)
+{
+    // the client may have been destroyed or moved in the dense array while the reply was on its way
+    Client* client = get_client(handle);
+    bool stale = client && client->properties[id].serial != serial;
+    if (client && !stale)
+    {
+        CachedProperty* property = client->properties + id;
+        if (reply)
+            property_store(property, xcb_get_property_value(reply), xcb_get_property_value_length(reply));
+        else
+            property_store(property, NULL, 0);
+    }
+
+    free(reply);
+
+    // a stale reply means the invalidation started a newer load, waiters keep waiting for that one
+    if (!stale)
+        resume_property_waiters(handle, id);
+}
+
+Task load_client_property(ClientHandle handle, u8 id)
+{
+    Client* client = get_client(handle);
+    u8 serial = client->properties[id].serial;
+    xcb_get_property_cookie_t cookie = request_client_property(client, id);
+
+    store_client_property(handle, id, serial, co_await xcb_await(xcb_get_property, cookie));
+}
+
+// co_await to have the property cached (or the client gone); joins a load in flight, starts one otherwise.
+PropertyAwaiter await_client_property(ClientHandle handle, u8 id)
+{
+    Client* client = get_client(handle);
+    if (client && client->properties[id].state == PropertyUnloaded)
+        load_client_property(handle, id);
+    return {.handle = handle, .id = id};
+}
+
+// Starts loading every listed property that is not cached or in flight yet.
+void prefetch_client_properties(ClientHandle handle, u32 mask)
+{
+    Client* client = get_client(handle);
+    if (!client)
+        return;
+
+    for (u8 id = 0; id < ClientPropertyCount; ++id)
+        if ((mask & (1u << id)) && client->properties[id].state == PropertyUnloaded)
+            load_client_property(handle, id);
+}
+
+// Returns true with the cached value (length 0 when the property is not set) or false while it is still loading; a
+// miss starts the load. The pointer stays valid until the next property is stored.
+bool get_client_property(ClientHandle handle, u8 id, const char** value, u32* length)
+{
+    Client* client = get_client(handle);
+    if (!client)
+        return false;
+
+    CachedProperty* property = client->properties + id;
+    if (property->state != PropertyValid)
+    {
+        if (property->state == PropertyUnloaded)
+            load_client_property(handle, id);
+        return false;
+    }
+
+    *value = propertyArena + property->offset;
+    *length = property->length;
+    return true;
+}
+
+u32 property_u32(const char* value, u32 index)
+{
+    u32 result;
+    memcpy(&result, value + index * sizeof(u32), sizeof(u32));
+    return result;
+}
+
+// _NET_WM_NAME when set, WM_NAME otherwise. Same contract as get_client_property, the value is not NUL-terminated.
+bool get_client_name(ClientHandle handle, const char** name, u32* length)
+{
+    bool netWmName = get_client_property(handle, ClientPropertyNetWmName, name, length);
+    if (netWmName && *length)
+        return true;
+
+    bool wmName = get_client_property(handle, ClientPropertyWmName, name, length);
+    return netWmName && wmName;
+}
+
+void invalidate_client_property(xcb_window_t win, xcb_atom_t atom)
+{
+    ClientHandle handle = find_client_handle(win);
+    if (!handle)
+        return;
+
+    for (u8 id = 0; id < ClientPropertyCount; ++id)
+    {
+        if (client_property_atom(id) != atom)
+            continue;
+
+        // only refetch what somebody has asked for before
+        CachedProperty* property = get_client(handle)->properties + id;
+        bool wasUsed = property->state != PropertyUnloaded;
+        property_release(property);
+        if (wasUsed)
+            load_client_property(handle, id);
+        return;
+    }
+}
+
+void release_client_properties(Client* client)
+{
+    for (auto& property : client->properties)
+        property_release(&property);
+}
+
+void watch_client(xcb_window_t win)
+{
+    xcb_tracked(xcb_change_window_attributes, win, XCB_CW_EVENT_MASK, (u32[]){XCB_EVENT_MASK_PROPERTY_CHANGE});
+}
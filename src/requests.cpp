@@ -0,0 +1,146 @@
+#include "nyla.hpp"
+
+// Hot-path requests are sent unchecked, so their errors arrive in the event stream. Each tracked request records
+// where it came from in a ring indexed by sequence number; an error is matched back through its full_sequence without
+// any round trip. Entries are overwritten after std::size(pendingRequests) newer requests, errors for requests that
+// old are reported without a call site.
+
+typedef struct
+{
+    u32 sequence;
+    const char* what;
+    const char* file;
+    int line;
+} PendingRequest;
+
+static PendingRequest pendingRequests[1024];
+
+// Protocol traffic accounting. Requests sent through xcb_send (and so xcb_tracked, xcb_async, xcb_reply and
+// xcb_checked) count themselves and their wire size in running totals, sampled around each handler so its request and
+// byte columns always cover the same requests, and in per-request totals. The size comes from the request struct xcb
+// generates for the fixed part plus the value list of the requests that carry one, so counting is a couple of adds;
+// 'metrics' reports it.
+
+// requests with their own line in the report, the rest are summed up as other
+#define WIRE_REQUESTS(X)                                                                                               \
+    X(xcb_configure_window)                                                                                            \
+    X(xcb_map_window)                                                                                                  \
+    X(xcb_set_input_focus)                                                                                             \
+    X(xcb_get_property)                                                                                                \
+    X(xcb_change_window_attributes)                                                                                    \
+    X(xcb_send_event)
+
+static constexpr const char* wireRequestNames[] = {
+#define X(name) #name,
+    WIRE_REQUESTS(X)
+#undef X
+    "other",
+};
+
+typedef struct
+{
+    u64 requests;
+    u64 bytes;
+} WireTotals;
+
+static struct
+{
+    u64 bytes; // ever sent
+    u64 sent;  // requests ever sent
+    WireTotals requests[std::size(wireRequestNames)];
+    u64 nsStart;
+} wireStats;
+
+static constexpr u32 wire_request_kind(const char* name)
+{
+    for (u32 kind = 0; kind + 1 < std::size(wireRequestNames); ++kind)
+    {
+        const char* a = name;
+        const char* b = wireRequestNames[kind];
+        while (*a && *a == *b)
+            ++a, ++b;
+        if (*a == *b)
+            return kind;
+    }
+    return std::size(wireRequestNames) - 1;
+}
+
+// Requests are padded to 4 bytes on the wire; the fixed parts already are.
+template <typename Request, typename... Args> static inline u32 request_bytes(Request*, Args...)
+{
+    return sizeof(Request);
+}
+
+static inline u32 request_bytes(xcb_configure_window_request_t*, xcb_window_t, u16 mask, const void*)
+{
+    return sizeof(xcb_configure_window_request_t) + 4 * __builtin_popcount(mask);
+}
+
+static inline u32 request_bytes(xcb_change_window_attributes_request_t*, xcb_window_t, u32 mask, const void*)
+{
+    return sizeof(xcb_change_window_attributes_request_t) + 4 * __builtin_popcount(mask);
+}
+
+static inline u32 request_bytes(xcb_intern_atom_request_t*, u8, u16 length, const char*)
+{
+    return sizeof(xcb_intern_atom_request_t) + ((length + 3) & ~3u);
+}
+
+// The arguments take the parameter types of the request function, as if it was called directly.
+template <u32 kind, typename Request, typename Cookie, typename... Params>
+static inline Cookie wire_send(Request* request,
+                               Cookie (*send)(xcb_connection_t*, Params...),
+                               std::type_identity_t<Params>... args)
+{
+    u32 bytes = request_bytes(request, args...);
+    wireStats.bytes += bytes;
+    ++wireStats.sent;
+    ++wireStats.requests[kind].requests;
+    wireStats.requests[kind].bytes += bytes;
+    return send(conn, args...);
+}
+
+// sends a request (name##_checked for checked ones) and accounts for it
+#define xcb_send_as(name, function, ...)                                                                              \
+    wire_send<wire_request_kind(#name)>((name##_request_t*)NULL, function, __VA_ARGS__)
+#define xcb_send(name, ...) xcb_send_as(name, name, __VA_ARGS__)
+
+static const char* const coreErrorNames[] = {
+    "Success",   "BadRequest", "BadValue",  "BadWindow",   "BadPixmap",   "BadAtom",   "BadCursor", "BadFont",
+    "BadMatch",  "BadDrawable", "BadAccess", "BadAlloc",   "BadColor",    "BadGC",     "BadIDChoice", "BadName",
+    "BadLength", "BadImplementation",
+};
+
+u32 track_request(u32 sequence, const char* what, const char* file, int line)
+{
+    pendingRequests[sequence % std::size(pendingRequests)] =
+        (PendingRequest){.sequence = sequence, .what = what, .file = file, .line = line};
+    return sequence;
+}
+
+void report_error(xcb_generic_error_t* error)
+{
+    const char* name = error->error_code < std::size(coreErrorNames) ? coreErrorNames[error->error_code] : "?";
+    PendingRequest* request = pendingRequests + error->full_sequence % std::size(pendingRequests);
+
+    if (request->what && request->sequence == error->full_sequence)
+    {
+        debug_fmt("X error %s (%d) resource %#x from %s at %s:%d",
+                  name,
+                  error->error_code,
+                  error->resource_id,
+                  request->what,
+                  request->file,
+                  request->line);
+    }
+    else
+    {
+        debug_fmt("X error %s (%d) resource %#x, untracked request %d.%d seq %u",
+                  name,
+                  error->error_code,
+                  error->resource_id,
+                  error->major_code,
+                  error->minor_code,
+                  error->full_sequence);
+    }
+}
@@ -0,0 +1,128 @@
+#include "nyla.hpp"
+
+// Synchronous round trip detector for debug builds. Every blocking reply or request check goes through xcb_reply,
+// xcb_wait or xcb_checked, which call round_trip() first. Outside the hot path (startup, scan) that does nothing; while
+// an event handler or a resumed task runs it counts the round trip against its call site and the path and logs it.
+// Each path has a budget of round trips per invocation; an invocation that goes over it logs a warning and counts as an
+// overrun, so a handler that starts blocking on the server shows up in the first debug run that reaches it instead of
+// quietly adding a round trip per event. 'roundtrips' on the control socket shows the numbers. Handlers should
+// xcb_await instead. Compiled out with NDEBUG.
+
+enum : u32
+{
+    RoundTripExtensionEvents = std::size(coreEventNames), // every extension event shares this path
+    RoundTripResume,                                      // a task resumed by a reply
+    RoundTripPaths,
+    RoundTripIdle = RoundTripPaths,
+};
+
+// path, synchronous round trips one invocation may make; paths that are not listed get none either
+#define ROUND_TRIP_BUDGETS(X)                                                                                          \
+    X(XCB_CREATE_NOTIFY, 0)                                                                                            \
+    X(XCB_DESTROY_NOTIFY, 0)                                                                                           \
+    X(XCB_CONFIGURE_REQUEST, 0)                                                                                        \
+    X(XCB_MAP_REQUEST, 0)                                                                                              \
+    X(XCB_PROPERTY_NOTIFY, 0)                                                                                          \
+    X(XCB_KEY_PRESS, 0)                                                                                                \
+    X(RoundTripExtensionEvents, 0)                                                                                     \
+    X(RoundTripResume, 0)
+
+typedef struct
+{
+    u8 paths[RoundTripPaths];
+} RoundTripBudgets;
+
+static constexpr RoundTripBudgets round_trip_budgets()
+{
+    RoundTripBudgets budgets = {};
+#define X(path, allowed) budgets.paths[path] = allowed;
+    ROUND_TRIP_BUDGETS(X)
+#undef X
+    return budgets;
+}
+
+static constexpr RoundTripBudgets roundTripBudgets = round_trip_budgets();
+
+typedef struct
+{
+    const char* what;
+    const char* file;
+    int line;
+    u32 path; // the path of the last hit
+    u64 count;
+} RoundTripSite;
+
+static struct
+{
+    u32 path;
+    u32 current; // round trips of the running handler or task
+    u64 paths[RoundTripPaths];
+    u64 overruns[RoundTripPaths]; // invocations that went over their budget
+    RoundTripSite sites[64];
+    u32 siteCount;
+} roundTrips = {.path = RoundTripIdle};
+
+static const char* round_trip_path_name(u32 path)
+{
+    if (path < RoundTripExtensionEvents)
+        return coreEventNames[path];
+    return path == RoundTripExtensionEvents ? "extension event" : "resumed task";
+}
+
+// Marks the start of a hot path; returns what round_trip_leave() needs to restore.
+static inline u64 round_trip_enter(u32 path)
+{
+#ifdef NDEBUG
+    return 0;
+#else
+    u64 saved = (u64)roundTrips.path << 32 | roundTrips.current;
+    roundTrips.path = path;
+    roundTrips.current = 0;
+    return saved;
+#endif
+}
+
+static inline void round_trip_leave(u64 saved)
+{
+#ifndef NDEBUG
+    u32 path = roundTrips.path;
+    if (roundTrips.current > roundTripBudgets.paths[path])
+    {
+        ++roundTrips.overruns[path];
+        debug_fmt("warning: %s made %u synchronous round trips, its budget is %u",
+                  round_trip_path_name(path),
+                  roundTrips.current,
+                  roundTripBudgets.paths[path]);
+    }
+
+    roundTrips.path = saved >> 32;
+    roundTrips.current = (u32)saved;
+#endif
+}
+
+void note_round_trip(const char* what, const char* file, int line)
+{
+    u32 path = roundTrips.path;
+    if (path == RoundTripIdle)
+        return;
+
+    ++roundTrips.paths[path];
+    ++roundTrips.current;
+
+    RoundTripSite* site = NULL;
+    for (u32 i = 0; i < roundTrips.siteCount && !site; ++i)
+        if (roundTrips.sites[i].file == file && roundTrips.sites[i].line == line)
+            site = roundTrips.sites + i;
+    if (!site && roundTrips.siteCount < std::size(roundTrips.sites))
+    {
+        site = roundTrips.sites + roundTrips.siteCount++;
+        *site = (RoundTripSite){.what = what, .file = file, .line = line};
+    }
+    if (site)
+    {
+        site->path = path;
+        ++site->count;
+    }
+
+    debug_fmt("round trip %s at %s:%d while handling %s", what, file, line, round_trip_path_name(path));
+}
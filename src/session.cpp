@@ -0,0 +1,390 @@
+#include "nyla.hpp"
+
+#include <span>
+
+#include <sys/mman.h>
+
+// Crash-safe session snapshot. The layout lives in a small fixed-size file under $XDG_RUNTIME_DIR that stays mapped
+// MAP_SHARED and is updated in place with plain stores, there is no write() or msync() anywhere: the dirty pages belong
+// to the page cache, so whatever was stored last survives the process dying (the assert macro writes through NULL).
+// Only a clean quit marks the file as done with; after anything else the next start restores from it.
+//
+// Windows are keyed by id, which outlives the WM since nyla does not reparent, and by _NET_WM_PID and a hash of
+// WM_CLASS on top: an id is only trusted while the owner still matches, and entries whose window is gone stay around as
+// orphans for the next window of the same process or class to claim when it is placed, until the restore window is
+// over. The window table starts at 64 entries and the file doubles whenever it is full.
+
+enum : u32
+{
+    SessionMagic = 0x73796c6e, // "nlys"
+    SessionVersion = 2,
+    SessionInitialCapacity = 64,
+};
+
+enum : u8
+{
+    SessionSlotFree,
+    SessionSlotLive,
+    SessionSlotOrphan,
+};
+
+enum : u8
+{
+    SessionColumnNone = 0xFF,
+};
+
+typedef struct
+{
+    xcb_window_t win;
+    i32 pid;       // 0 when unknown
+    u32 classHash; // 0 when unknown
+    u8 state;      // written last, a torn update leaves the previous state
+    u8 column;     // index into activeClients or SessionColumnNone
+    u8 floating;
+    u8 pooled; // a warm terminal kept unmapped for the terminal pool
+} SessionWindow;
+
+typedef struct
+{
+    u32 magic;
+    u32 version;
+    u32 clean; // set by a clean quit
+    u8 activeCol;
+    u8 pad[3];
+    u32 capacity; // SessionWindow entries following the header, stored after the file has grown
+} Session;
+
+static Session* session;
+static int sessionFd = -1;
+
+static size_t session_file_size(u32 capacity)
+{
+    return sizeof(Session) + (size_t)capacity * sizeof(SessionWindow);
+}
+
+static std::span<SessionWindow> session_windows()
+{
+    return {(SessionWindow*)(session + 1), session->capacity};
+}
+
+// Doubles the window table. Returns false when the file could not grow, the table is unchanged then.
+static bool session_grow()
+{
+    u32 capacity = session->capacity * 2;
+    size_t oldSize = session_file_size(session->capacity);
+    if (ftruncate(sessionFd, session_file_size(capacity)))
+        return false;
+
+    void* data = mremap(session, oldSize, session_file_size(capacity), MREMAP_MAYMOVE);
+    if (data == MAP_FAILED)
+    {
+        if (ftruncate(sessionFd, oldSize))
+            debug_fmts("could not shrink the session file back");
+        return false;
+    }
+
+    session = (Session*)data;
+    session->capacity = capacity;
+    debug_fmt("session snapshot grown to %u windows", capacity);
+    return true;
+}
+
+// Maps the session file, starting a fresh session unless the previous instance went away without a clean quit. Returns
+// true when there is a snapshot to recover from. Without XDG_RUNTIME_DIR every session_ call is a no-op.
+bool session_open()
+{
+    const char* runtimeDir = getenv("XDG_RUNTIME_DIR");
+    if (!runtimeDir)
+    {
+        debug_fmts("XDG_RUNTIME_DIR is not set, no session snapshot");
+        return false;
+    }
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/nyla-session", runtimeDir);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        debug_fmt("could not open %s", path);
+        return false;
+    }
+
+    struct stat st;
+    size_t size = !fstat(fd, &st) && (size_t)st.st_size >= sizeof(Session) ? (size_t)st.st_size : 0;
+    void* data = size ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    const Session* previous = data != MAP_FAILED ? (const Session*)data : NULL;
+
+    bool recoverable = previous && previous->magic == SessionMagic && previous->version == SessionVersion &&
+                       !previous->clean && previous->capacity && session_file_size(previous->capacity) <= size;
+    if (!recoverable)
+    {
+        if (previous)
+            munmap(data, size);
+
+        size = session_file_size(SessionInitialCapacity);
+        data = MAP_FAILED;
+        if (!ftruncate(fd, 0) && !ftruncate(fd, size))
+            data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+
+        session = (Session*)data;
+        session->magic = SessionMagic;
+        session->version = SessionVersion;
+        session->capacity = SessionInitialCapacity;
+    }
+    else
+    {
+        session = (Session*)data;
+
+        // a crash while growing leaves the file larger than the table, trimmed so growing starts from the table size
+        size_t used = session_file_size(session->capacity);
+        if (size > used)
+        {
+            void* trimmed = mremap(data, size, used, 0);
+            if (trimmed != MAP_FAILED)
+                session = (Session*)trimmed;
+            if (ftruncate(fd, used))
+                debug_fmts("could not trim the session file");
+        }
+    }
+
+    sessionFd = fd;
+
+    session->clean = 0;
+    return recoverable;
+}
+
+void session_close()
+{
+    if (session)
+        session->clean = 1;
+}
+
+static u32 session_class_hash(const char* value, u32 length)
+{
+    // FNV-1a over instance and class, including the NUL in between
+    u32 hash = 2166136261u;
+    for (u32 i = 0; i < length; ++i)
+        hash = (hash ^ (u8)value[i]) * 16777619u;
+    return hash ? hash : 1;
+}
+
+static void session_client_key(ClientHandle handle, i32* pid, u32* classHash)
+{
+    const char* value;
+    u32 length;
+
+    *pid = get_client_property(handle, ClientPropertyNetWmPid, &value, &length) && length >= 4
+               ? (i32)property_u32(value, 0)
+               : 0;
+    *classHash = get_client_property(handle, ClientPropertyWmClass, &value, &length) && length
+                     ? session_class_hash(value, length)
+                     : 0;
+}
+
+static SessionWindow* session_find(xcb_window_t win)
+{
+    for (auto& slot : session_windows())
+        if (slot.state == SessionSlotLive && slot.win == win)
+            return &slot;
+    return NULL;
+}
+
+// Takes a free entry, grows the table when there is none and only falls back to overwriting an orphan after that.
+static SessionWindow* session_alloc()
+{
+    SessionWindow* orphan = NULL;
+    for (auto& slot : session_windows())
+    {
+        if (slot.state == SessionSlotFree)
+            return &slot;
+        if (slot.state == SessionSlotOrphan && !orphan)
+            orphan = &slot;
+    }
+
+    u32 capacity = session->capacity;
+    if (session_grow())
+        return &session_windows()[capacity];
+    return orphan;
+}
+
+// Records the window, or refreshes what is known about it. Keys that are not cached yet keep their old value.
+void session_note_client(ClientHandle handle)
+{
+    Client* client = get_client(handle);
+    if (!session || !client)
+        return;
+
+    SessionWindow* slot = session_find(client->win);
+    if (!slot)
+    {
+        slot = session_alloc();
+        if (!slot)
+            return;
+
+        *slot = (SessionWindow){.win = client->win, .state = SessionSlotFree, .column = SessionColumnNone};
+    }
+
+    i32 pid;
+    u32 classHash;
+    session_client_key(handle, &pid, &classHash);
+    if (pid)
+        slot->pid = pid;
+    if (classHash)
+        slot->classHash = classHash;
+    slot->floating = !!(client->flags & ClientFlagFloating);
+    slot->pooled = !!(client->flags & ClientFlagPooled);
+    slot->state = SessionSlotLive;
+}
+
+void session_forget_window(xcb_window_t win)
+{
+    if (!session)
+        return;
+
+    if (SessionWindow* slot = session_find(win))
+        slot->state = SessionSlotFree;
+}
+
+// Called whenever the columns or the active column change; touches only the entries whose column moved.
+void session_note_layout(const ClientHandle* columns, u32 columnCount, u8 activeCol)
+{
+    if (!session)
+        return;
+
+    xcb_window_t windows[2] = {};
+    for (u32 col = 0; col < columnCount && col < std::size(windows); ++col)
+    {
+        if (Client* client = get_client(columns[col]))
+        {
+            windows[col] = client->win;
+            if (!session_find(client->win))
+                session_note_client(columns[col]);
+        }
+    }
+
+    for (auto& slot : session_windows())
+    {
+        if (slot.state != SessionSlotLive)
+            continue;
+
+        u8 column = slot.win == windows[0] ? 0 : slot.win == windows[1] ? 1 : SessionColumnNone;
+        if (slot.column != column)
+            slot.column = column;
+    }
+
+    if (session->activeCol != activeCol)
+        session->activeCol = activeCol;
+}
+
+// One pass over the snapshot a crashed instance left behind, the keys come from the property cache. Windows that are
+// still there and still look the same get their column, floating and pooled state back; the others become orphans for
+// session_claim(). Returns how many windows went back into a column.
+u32 session_restore(ClientHandle* columns, u32 columnCount, u8* activeCol)
+{
+    if (!session)
+        return 0;
+
+    u32 restored = 0;
+    for (auto& slot : session_windows())
+    {
+        if (slot.state != SessionSlotLive)
+            continue;
+
+        ClientHandle handle = find_client_handle(slot.win);
+        i32 pid = 0;
+        u32 classHash = 0;
+        if (handle)
+            session_client_key(handle, &pid, &classHash);
+
+        // window ids get reused, a different owner means the window we knew is gone
+        if (!handle || (pid && slot.pid && pid != slot.pid) ||
+            (classHash && slot.classHash && classHash != slot.classHash))
+        {
+            bool claimable = (slot.pid || slot.classHash) && (slot.column != SessionColumnNone || slot.floating);
+            slot.win = XCB_NONE;
+            slot.state = claimable ? SessionSlotOrphan : SessionSlotFree;
+            continue;
+        }
+
+        if (slot.floating)
+            get_client(handle)->flags |= ClientFlagFloating;
+        if (slot.pooled)
+            get_client(handle)->flags |= ClientFlagPooled;
+        if (slot.column < columnCount)
+        {
+            columns[slot.column] = handle;
+            ++restored;
+        }
+    }
+
+    *activeCol = session->activeCol;
+    return restored;
+}
+
+// Called once the restore window is over: windows of the crashed session that have not come back by now are not
+// coming back, and an orphan left around would hand its column to an unrelated window of the same class much later.
+void session_expire_orphans()
+{
+    if (!session)
+        return;
+
+    u32 expired = 0;
+    for (auto& slot : session_windows())
+    {
+        if (slot.state == SessionSlotOrphan)
+        {
+            slot.state = SessionSlotFree;
+            ++expired;
+        }
+    }
+    if (expired)
+        debug_fmt("session: %u windows of the crashed session did not come back", expired);
+}
+
+// Hands a new window the place of an orphan from the same process, or failing that of the same WM_CLASS. Returns the
+// column the orphan had or SessionColumnNone; the entry itself is live again and gets its column from the next layout.
+u8 session_claim(ClientHandle handle)
+{
+    Client* client = get_client(handle);
+    if (!session || !client)
+        return SessionColumnNone;
+
+    i32 pid;
+    u32 classHash;
+    session_client_key(handle, &pid, &classHash);
+
+    SessionWindow* match = NULL;
+    for (auto& slot : session_windows())
+    {
+        if (slot.state != SessionSlotOrphan)
+            continue;
+
+        if (pid && slot.pid == pid)
+        {
+            match = &slot;
+            break;
+        }
+        if (!match && classHash && slot.classHash == classHash)
+            match = &slot;
+    }
+
+    if (!match)
+        return SessionColumnNone;
+
+    u8 column = match->column;
+    if (match->floating)
+        client->flags |= ClientFlagFloating;
+
+    match->win = client->win;
+    match->pid = pid;
+    match->classHash = classHash;
+    match->column = SessionColumnNone;
+    match->state = SessionSlotLive;
+    return column;
+}
@@ -0,0 +1,145 @@
+#include "nyla.hpp"
+
+// Opt-in span tracing. trace_span() marks a scope; while a capture runs every span appends (name, start, end) in TSC
+// cycles to a preallocated buffer, nothing else. Stopping the capture writes it as Chrome trace-event JSON, complete
+// ("X") events nest by time, so the file loads as is in Perfetto or chrome://tracing. Captures are started and
+// stopped with SIGUSR2 or 'trace start [seconds]' / 'trace stop' on the control socket; a full buffer ends the capture
+// early. The file is written from the loop, a few ms per 100k spans.
+//
+// The file is NYLA_TRACE, by default $XDG_RUNTIME_DIR/nyla-trace.json.
+
+enum : u32
+{
+    TraceCapacity = 1 << 19, // about a minute of a busy loop
+};
+
+typedef struct
+{
+    const char* name;
+    u64 start;
+    u64 end;
+} TraceEvent;
+
+bool traceEnabled;
+
+static struct
+{
+    TraceEvent* events;
+    u32 count;
+    bool full;
+    u64 tscStart;
+    u64 nsStart;
+    int stopTimer;
+    char path[256];
+} tracer;
+
+void trace_record(const char* name, u64 startTsc, u64 endTsc)
+{
+    // spans that were open when the capture stopped
+    if (!traceEnabled)
+        return;
+
+    if (tracer.count == TraceCapacity)
+    {
+        // finish from the loop, not from inside whatever span just ended
+        traceEnabled = false;
+        tracer.full = true;
+        loop_arm_timer(tracer.stopTimer, 1, 0);
+        return;
+    }
+
+    tracer.events[tracer.count++] = (TraceEvent){.name = name, .start = startTsc, .end = endTsc};
+}
+
+static void trace_write()
+{
+    u64 tscEnd = read_tsc();
+    u64 nsEnd = now_ns();
+    double usPerTick =
+        tscEnd > tracer.tscStart ? (double)(nsEnd - tracer.nsStart) / (double)(tscEnd - tracer.tscStart) / 1e3 : 1e-3;
+
+    FILE* out = fopen(tracer.path, "w");
+    if (!out)
+    {
+        debug_fmt("could not write trace to %s", tracer.path);
+        return;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"nyla\"}}", getpid());
+    for (u32 i = 0; i < tracer.count; ++i)
+    {
+        TraceEvent* event = tracer.events + i;
+        fprintf(out,
+                ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":1}",
+                event->name,
+                (event->start - tracer.tscStart) * usPerTick,
+                (event->end - event->start) * usPerTick,
+                getpid());
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+
+    debug_fmt("trace: %u spans over %.3fms written to %s%s",
+              tracer.count,
+              ns_to_ms(nsEnd - tracer.nsStart),
+              tracer.path,
+              tracer.full ? " (buffer full)" : "");
+}
+
+bool trace_start(u32 seconds)
+{
+    if (traceEnabled || tracer.events)
+        return false;
+
+    tracer.events = (TraceEvent*)malloc(sizeof(TraceEvent) * TraceCapacity);
+    if (!tracer.events)
+        return false;
+
+    tracer.count = 0;
+    tracer.full = false;
+    tracer.tscStart = read_tsc();
+    tracer.nsStart = now_ns();
+    traceEnabled = true;
+
+    if (seconds)
+        loop_arm_timer(tracer.stopTimer, seconds * 1000000000ull, 0);
+    return true;
+}
+
+bool trace_stop()
+{
+    if (!tracer.events)
+        return false;
+
+    traceEnabled = false;
+    loop_arm_timer(tracer.stopTimer, 0, 0);
+    trace_write();
+
+    free(tracer.events);
+    tracer.events = NULL;
+    return true;
+}
+
+static void trace_timeout(void* data, u64 expirations)
+{
+    trace_stop();
+}
+
+void trace_toggle(void* data, u64 signo)
+{
+    if (!trace_stop())
+        trace_start(0);
+}
+
+void trace_init()
+{
+    const char* path = getenv("NYLA_TRACE");
+    const char* runtimeDir = getenv("XDG_RUNTIME_DIR");
+    if (path && *path)
+        snprintf(tracer.path, sizeof(tracer.path), "%s", path);
+    else
+        snprintf(tracer.path, sizeof(tracer.path), "%s/nyla-trace.json", runtimeDir ? runtimeDir : "/tmp");
+
+    tracer.stopTimer = loop_add_timer(0, 0, trace_timeout, NULL);
+}
@@ -0,0 +1,197 @@
+#include "nyla.hpp"
+
+#include <execinfo.h>
+#include <pthread.h>
+
+// Event loop stall watchdog. The loop stamps a heartbeat when it wakes up and clears it before it goes back to sleep,
+// so an idle WM never looks stalled. A watchdog thread polls the heartbeat while a batch is being handled and sleeps on
+// a futex while the loop waits, so idling costs no wakeups. Once one iteration has been busy for longer than the
+// threshold it interrupts the loop thread with a signal whose handler only records a backtrace(), then logs
+// the symbolized stack together with the newest flight recorder entries and writes a flight recorder dump. Whatever
+// the loop was blocked in (a synchronous reply, a GL call, a write) is on that stack. The loop itself measures how
+// long each stall lasted; 'stalls' on the control socket shows the statistics.
+//
+// NYLA_STALL_MS sets the threshold (default 200), 0 turns the watchdog off. Frame names need -rdynamic, without it
+// the addresses can be resolved with addr2line.
+
+typedef struct
+{
+    u64 count;
+    u64 totalNs;
+    u64 maxNs;
+    u64 buckets[4]; // [1, 2), [2, 4), [4, 8) and 8 or more times the threshold
+} StallStats;
+
+static struct
+{
+    std::atomic<u64> heartbeat; // CLOCK_MONOTONIC when the current iteration started, 0 while waiting
+    std::atomic<u32> parked;    // the watchdog thread waits for the next heartbeat
+    u64 thresholdNs;
+    pthread_t loopThread;
+    int captureSignal;
+
+    // written by the signal handler on the loop thread, read by the watchdog thread
+    void* frames[48];
+    int frameCount;
+    std::atomic<bool> captured;
+
+    u64 captures;
+    StallStats stalls;
+} watchdog;
+
+static void watchdog_capture(int signo)
+{
+    watchdog.frameCount = backtrace(watchdog.frames, std::size(watchdog.frames));
+    watchdog.captured.store(true, std::memory_order_release);
+}
+
+static inline void watchdog_busy()
+{
+    if (!watchdog.thresholdNs)
+        return;
+
+    watchdog.heartbeat.store(now_ns(), std::memory_order_release);
+
+    // pairs with the fence in watchdog_thread: either it sees the heartbeat or this sees it parked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (watchdog.parked.load(std::memory_order_relaxed) && watchdog.parked.exchange(0, std::memory_order_relaxed))
+        watchdog.parked.notify_one();
+}
+
+static inline void watchdog_idle()
+{
+    if (!watchdog.thresholdNs)
+        return;
+
+    u64 busySince = watchdog.heartbeat.exchange(0, std::memory_order_acq_rel);
+    u64 busy = now_ns() - busySince;
+    if (!busySince || busy < watchdog.thresholdNs)
+        return;
+
+    StallStats* stalls = &watchdog.stalls;
+    ++stalls->count;
+    stalls->totalNs += busy;
+    if (busy > stalls->maxNs)
+        stalls->maxNs = busy;
+
+    u32 bucket = 0;
+    while (bucket + 1 < std::size(stalls->buckets) && busy >= (watchdog.thresholdNs << (bucket + 1)))
+        ++bucket;
+    ++stalls->buckets[bucket];
+
+    debug_fmt("stall: loop iteration took %.3fms", ns_to_ms(busy));
+}
+
+static void watchdog_report(u64 busyNs)
+{
+    debug_fmt("stall: loop busy for %.3fms, stack of the loop thread:", ns_to_ms(busyNs));
+
+    char** symbols = backtrace_symbols(watchdog.frames, watchdog.frameCount);
+    // the first two frames are the signal handler and the signal trampoline
+    for (int i = 2; i < watchdog.frameCount; ++i)
+    {
+        if (symbols)
+            debug_fmt("  #%d %s", i - 2, symbols[i]);
+        else
+            debug_fmt("  #%d %p", i - 2, watchdog.frames[i]);
+    }
+    free(symbols);
+
+    // racy by nature, the loop keeps writing the ring; good enough to see what it was dispatching
+    u64 next = flightRecorder.next;
+    for (u64 i = next > 8 ? next - 8 : 0; i < next; ++i)
+    {
+        FlightEntry* entry = flightRecorder.entries + (i & (FlightCapacity - 1));
+        u8 type = entry->type & 0x7F;
+        debug_fmt("  event %s window %#x seq %u%s",
+                  type < std::size(coreEventNames) ? coreEventNames[type] : "extension",
+                  entry->window,
+                  entry->sequence,
+                  entry->cycles == FlightRunning ? " <- running" : "");
+    }
+
+    if (flight_dump(watchdog.captureSignal))
+        debug_fmt("stall: flight recorder dumped to %s", flightRecorder.path);
+}
+
+static void* watchdog_thread(void*)
+{
+    u64 reported = 0;
+    u64 periodNs = watchdog.thresholdNs / 4;
+    struct timespec period = {
+        .tv_sec = (time_t)(periodNs / 1000000000ull),
+        .tv_nsec = (long)(periodNs % 1000000000ull),
+    };
+
+    for (;;)
+    {
+        if (!watchdog.heartbeat.load(std::memory_order_acquire))
+        {
+            watchdog.parked.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!watchdog.heartbeat.load(std::memory_order_relaxed))
+                watchdog.parked.wait(1, std::memory_order_relaxed);
+            watchdog.parked.store(0, std::memory_order_relaxed);
+            continue;
+        }
+
+        nanosleep(&period, NULL);
+
+        u64 busySince = watchdog.heartbeat.load(std::memory_order_acquire);
+        if (!busySince || busySince == reported)
+            continue;
+
+        u64 busy = now_ns() - busySince;
+        if (busy < watchdog.thresholdNs)
+            continue;
+
+        // once per stalled iteration
+        reported = busySince;
+        ++watchdog.captures;
+
+        watchdog.captured.store(false, std::memory_order_relaxed);
+        pthread_kill(watchdog.loopThread, watchdog.captureSignal);
+
+        for (int i = 0; i < 100 && !watchdog.captured.load(std::memory_order_acquire); ++i)
+        {
+            struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000};
+            nanosleep(&ts, NULL);
+        }
+
+        if (watchdog.captured.load(std::memory_order_acquire))
+            watchdog_report(busy);
+        else
+            debug_fmt("stall: loop busy for %.3fms, no stack (signal not handled)", ns_to_ms(busy));
+    }
+    return NULL;
+}
+
+// Call from the loop thread.
+void watchdog_init()
+{
+    const char* threshold = getenv("NYLA_STALL_MS");
+    u64 thresholdMs = threshold && *threshold ? strtoull(threshold, NULL, 10) : 200;
+    if (!thresholdMs)
+        return;
+
+    watchdog.thresholdNs = thresholdMs * 1000000ull;
+    watchdog.loopThread = pthread_self();
+    watchdog.captureSignal = SIGRTMIN;
+
+    // the first backtrace() loads libgcc, which is not something to do inside a signal handler
+    backtrace(watchdog.frames, 1);
+
+    struct sigaction action = {};
+    action.sa_handler = watchdog_capture;
+    action.sa_flags = SA_RESTART | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(watchdog.captureSignal, &action, NULL);
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    pthread_create(&thread, NULL, watchdog_thread, NULL);
+    pthread_setname_np(thread, "nyla-watchdog");
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}